@@ -1,18 +1,41 @@
 import esphome.codegen as cg
 import esphome.config_validation as cv
+import esphome.final_validate as fv
 from esphome.components import light
+from esphome.components import sensor
+from esphome.components import text_sensor
 from esphome.components import time as time_
-from esphome.const import CONF_ID
+from esphome.const import (
+    CONF_ID,
+    CONF_UPDATE_INTERVAL,
+    ENTITY_CATEGORY_DIAGNOSTIC,
+    STATE_CLASS_MEASUREMENT,
+    STATE_CLASS_TOTAL_INCREASING,
+)
 from esphome.core import CORE
 
 CODEOWNERS = ["@giantorth"]
+AUTO_LOAD = ["sensor", "text_sensor"]
+# One block per virtual bulb, all sharing the UDP listener (LIFX_MAX_VIRTUAL_DEVICES)
+MULTI_CONF = 8
+# Each bulb keeps about 4 KB of state; more than this leaves an ESP8266 short of heap
+ESP8266_MAX_BULBS = 2
 
 lifx_emulation_ns = cg.esphome_ns.namespace("lifx_emulation")
 LifxEmulation = lifx_emulation_ns.class_("LifxEmulation", cg.Component)
+LifxLatencyStage = lifx_emulation_ns.enum("LifxLatencyStage")
 
 CONF_COLOR_LED = "color_led"
 CONF_WHITE_LED = "white_led"
 CONF_RGBWW_LED = "rgbww_led"
+CONF_STRIP_LED = "strip_led"
+CONF_ZONES = "zones"
+CONF_TILE_LED = "tile_led"
+CONF_TILE_WIDTH = "tile_width"
+CONF_TILE_HEIGHT = "tile_height"
+CONF_TILE_SERPENTINE = "tile_serpentine"
+CONF_TILE_FRAMEBUFFERS = "tile_framebuffers"
+TILE_OPTIONS = (CONF_TILE_WIDTH, CONF_TILE_HEIGHT, CONF_TILE_SERPENTINE, CONF_TILE_FRAMEBUFFERS)
 CONF_BULB_LABEL = "bulb_label"
 CONF_BULB_LOCATION = "bulb_location"
 CONF_BULB_LOCATION_GUID = "bulb_location_guid"
@@ -22,22 +45,84 @@ CONF_BULB_GROUP_GUID = "bulb_group_guid"
 CONF_BULB_GROUP_TIME = "bulb_group_time"
 CONF_TIME_ID = "time_id"
 CONF_DEBUG = "debug"
+CONF_PRECISE_COLOR = "precise_color"
+CONF_RX_QUEUE_SIZE = "rx_queue_size"
+CONF_SAVE_DELAY = "save_delay"
+CONF_WAVEFORM_FPS = "waveform_fps"
+CONF_TRANSITION_FPS = "transition_fps"
+CONF_DISCOVERY_JITTER = "discovery_jitter"
+CONF_TRACE_SIZE = "trace_size"
+CONF_STATS = "stats"
+CONF_PACKET_RATE = "packet_rate"
+CONF_DROPPED_PACKETS = "dropped_packets"
+CONF_COALESCED_UPDATES = "coalesced_updates"
+CONF_SUMMARY = "summary"
+LATENCY_STAGES = {
+    "receive_latency": LifxLatencyStage.LATENCY_RECEIVE,
+    "dispatch_latency": LifxLatencyStage.LATENCY_DISPATCH,
+    "light_latency": LifxLatencyStage.LATENCY_LIGHT,
+    "save_latency": LifxLatencyStage.LATENCY_SAVE,
+    "send_latency": LifxLatencyStage.LATENCY_SEND,
+}
+
+_latency_sensor = sensor.sensor_schema(
+    unit_of_measurement="µs",
+    icon="mdi:timer-outline",
+    accuracy_decimals=0,
+    state_class=STATE_CLASS_MEASUREMENT,
+    entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+)
+_counter_sensor = sensor.sensor_schema(
+    accuracy_decimals=0,
+    state_class=STATE_CLASS_TOTAL_INCREASING,
+    entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+)
+
+STATS_SCHEMA = cv.Schema(
+    {
+        cv.Optional(CONF_UPDATE_INTERVAL, default="60s"): cv.update_interval,
+        **{cv.Optional(key): _latency_sensor for key in LATENCY_STAGES},
+        cv.Optional(CONF_PACKET_RATE): sensor.sensor_schema(
+            unit_of_measurement="packets/s",
+            icon="mdi:swap-vertical",
+            accuracy_decimals=1,
+            state_class=STATE_CLASS_MEASUREMENT,
+            entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+        ),
+        cv.Optional(CONF_DROPPED_PACKETS): _counter_sensor,
+        cv.Optional(CONF_COALESCED_UPDATES): _counter_sensor,
+        cv.Optional(CONF_SUMMARY): text_sensor.text_sensor_schema(
+            icon="mdi:chart-histogram",
+            entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+        ),
+    }
+)
 
 
 def _validate_light_config(config):
     has_dual = CONF_COLOR_LED in config and CONF_WHITE_LED in config
     has_rgbww = CONF_RGBWW_LED in config
+    has_strip = CONF_STRIP_LED in config
+    has_tile = CONF_TILE_LED in config
 
-    if has_dual and has_rgbww:
+    if has_dual + has_rgbww + has_strip + has_tile > 1:
         raise cv.Invalid(
-            "Cannot specify both 'rgbww_led' and 'color_led'/'white_led'. "
-            "Use either a combined RGBWW light OR separate color + white lights."
+            "Specify only one of 'rgbww_led', 'color_led'/'white_led', 'strip_led' or 'tile_led'. "
+            "Use either a combined RGBWW light, separate color + white lights, "
+            "an addressable strip OR an addressable matrix."
         )
-    if not has_dual and not has_rgbww:
+    if not has_dual and not has_rgbww and not has_strip and not has_tile:
         raise cv.Invalid(
             "Must specify either 'rgbww_led' for a combined RGBWW light, "
-            "or both 'color_led' and 'white_led' for separate lights."
+            "both 'color_led' and 'white_led' for separate lights, "
+            "'strip_led' for an addressable strip "
+            "or 'tile_led' for an addressable matrix."
         )
+    if CONF_ZONES in config and not has_strip:
+        raise cv.Invalid("'zones' requires 'strip_led'.")
+    for option in TILE_OPTIONS:
+        if option in config and not has_tile:
+            raise cv.Invalid(f"'{option}' requires 'tile_led'.")
     if (CONF_COLOR_LED in config) != (CONF_WHITE_LED in config):
         raise cv.Invalid(
             "Both 'color_led' and 'white_led' must be specified together."
@@ -52,6 +137,17 @@ CONFIG_SCHEMA = cv.All(
             cv.Optional(CONF_COLOR_LED): cv.use_id(light.LightState),
             cv.Optional(CONF_WHITE_LED): cv.use_id(light.LightState),
             cv.Optional(CONF_RGBWW_LED): cv.use_id(light.LightState),
+            cv.Optional(CONF_STRIP_LED): cv.use_id(light.AddressableLightState),
+            # Defaults to one zone per LED
+            cv.Optional(CONF_ZONES): cv.int_range(min=1, max=255),
+            # Matrix shown as one LIFX Tile, default 8x8
+            cv.Optional(CONF_TILE_LED): cv.use_id(light.AddressableLightState),
+            cv.Optional(CONF_TILE_WIDTH): cv.int_range(min=1, max=16),
+            cv.Optional(CONF_TILE_HEIGHT): cv.int_range(min=1, max=16),
+            # Odd rows wired right to left
+            cv.Optional(CONF_TILE_SERPENTINE): cv.boolean,
+            # Including the shown framebuffer, default 2
+            cv.Optional(CONF_TILE_FRAMEBUFFERS): cv.int_range(min=1, max=8),
             cv.Required(CONF_TIME_ID): cv.use_id(time_.RealTimeClock),
             cv.Optional(CONF_BULB_LABEL, default=""): cv.string,
             cv.Optional(CONF_BULB_LOCATION, default="ESPHome"): cv.string,
@@ -67,19 +163,69 @@ CONFIG_SCHEMA = cv.All(
             ): cv.string,
             cv.Optional(CONF_BULB_GROUP_TIME, default=1600213602318000000): cv.positive_int,
             cv.Optional(CONF_DEBUG, default=False): cv.boolean,
+            # 16-bit color path with blackbody white mixing for rgbww/dual lights
+            cv.Optional(CONF_PRECISE_COLOR, default=False): cv.boolean,
+            # Frames buffered for loop(); 0 handles packets in the UDP callback
+            cv.Optional(CONF_RX_QUEUE_SIZE, default=8): cv.int_range(min=0, max=64),
+            # Quiet period before label/location/group/cloud changes hit flash
+            cv.Optional(
+                CONF_SAVE_DELAY, default="5s"
+            ): cv.positive_time_period_milliseconds,
+            # Highest frame rate waveform effects are rendered at
+            cv.Optional(CONF_WAVEFORM_FPS, default=20): cv.int_range(min=1, max=100),
+            cv.Optional(CONF_TRANSITION_FPS, default=20): cv.int_range(min=0, max=100),
+            # Spread GetService replies over this window; 0 answers at once
+            cv.Optional(CONF_DISCOVERY_JITTER, default="0ms"): cv.All(
+                cv.positive_time_period_milliseconds,
+                cv.Range(max=cv.TimePeriod(milliseconds=2000)),
+            ),
+            # Binary packet trace kept in RAM (16 bytes per record), dumped on demand
+            cv.Optional(CONF_TRACE_SIZE, default=0): cv.int_range(min=0, max=2048),
+            # Hot path latency histograms and packet rates as sensors
+            cv.Optional(CONF_STATS): STATS_SCHEMA,
         }
     ).extend(cv.COMPONENT_SCHEMA),
     _validate_light_config,
 )
 
 
+
+def _final_validate(config):
+    blocks = fv.full_config.get()["lifx_emulation"]
+    if CORE.is_esp8266 and len(blocks) > ESP8266_MAX_BULBS:
+        raise cv.Invalid(
+            f"An ESP8266 has room for at most {ESP8266_MAX_BULBS} 'lifx_emulation' blocks "
+            "(about 4 KB of RAM each); use an ESP32 for more bulbs."
+        )
+    return config
+
+
+FINAL_VALIDATE_SCHEMA = _final_validate
+
+
 async def to_code(config):
     var = cg.new_Pvariable(config[CONF_ID])
     await cg.register_component(var, config)
 
+    # Blocks are numbered in YAML order; the first keeps the hardware MAC
+    index = CORE.data.setdefault("lifx_emulation", {"count": 0})["count"]
+    CORE.data["lifx_emulation"]["count"] = index + 1
+    cg.add(var.set_device_index(index))
+
     if CONF_RGBWW_LED in config:
         rgbww_led = await cg.get_variable(config[CONF_RGBWW_LED])
         cg.add(var.set_rgbww_led(rgbww_led))
+    elif CONF_STRIP_LED in config:
+        strip_led = await cg.get_variable(config[CONF_STRIP_LED])
+        cg.add(var.set_strip_led(strip_led))
+        if CONF_ZONES in config:
+            cg.add(var.set_zones(config[CONF_ZONES]))
+    elif CONF_TILE_LED in config:
+        tile_led = await cg.get_variable(config[CONF_TILE_LED])
+        cg.add(var.set_tile_led(tile_led))
+        cg.add(var.set_tile_size(config.get(CONF_TILE_WIDTH, 8), config.get(CONF_TILE_HEIGHT, 8)))
+        cg.add(var.set_tile_serpentine(config.get(CONF_TILE_SERPENTINE, False)))
+        cg.add(var.set_tile_framebuffers(config.get(CONF_TILE_FRAMEBUFFERS, 2)))
     else:
         color_led = await cg.get_variable(config[CONF_COLOR_LED])
         cg.add(var.set_color_led(color_led))
@@ -90,8 +236,8 @@ async def to_code(config):
     ha_time = await cg.get_variable(config[CONF_TIME_ID])
     cg.add(var.set_time(ha_time))
 
-    # Default label to the ESPHome device name if not explicitly set
-    label = config[CONF_BULB_LABEL] or CORE.name
+    # Default label to the ESPHome device name (numbered after the first) if not explicitly set
+    label = config[CONF_BULB_LABEL] or (CORE.name if index == 0 else f"{CORE.name} {index + 1}")
     cg.add(var.set_bulb_label(label))
 
     cg.add(var.set_bulb_location(config[CONF_BULB_LOCATION]))
@@ -102,5 +248,31 @@ async def to_code(config):
     cg.add(var.set_bulb_group_time(config[CONF_BULB_GROUP_TIME]))
 
     cg.add(var.set_debug(config[CONF_DEBUG]))
+    cg.add(var.set_precise_color(config[CONF_PRECISE_COLOR]))
+    cg.add(var.set_rx_queue_size(config[CONF_RX_QUEUE_SIZE]))
+    cg.add(var.set_save_delay(config[CONF_SAVE_DELAY].total_milliseconds))
+    cg.add(var.set_waveform_fps(config[CONF_WAVEFORM_FPS]))
+    cg.add(var.set_transition_fps(config[CONF_TRANSITION_FPS]))
+    cg.add(var.set_discovery_jitter(config[CONF_DISCOVERY_JITTER].total_milliseconds))
+    cg.add(var.set_trace_size(config[CONF_TRACE_SIZE]))
+
+    if stats := config.get(CONF_STATS):
+        cg.add(var.set_stats_interval(stats[CONF_UPDATE_INTERVAL].total_milliseconds))
+        for key, stage in LATENCY_STAGES.items():
+            if key in stats:
+                sens = await sensor.new_sensor(stats[key])
+                cg.add(var.set_latency_sensor(stage, sens))
+        if CONF_PACKET_RATE in stats:
+            sens = await sensor.new_sensor(stats[CONF_PACKET_RATE])
+            cg.add(var.set_packet_rate_sensor(sens))
+        if CONF_DROPPED_PACKETS in stats:
+            sens = await sensor.new_sensor(stats[CONF_DROPPED_PACKETS])
+            cg.add(var.set_dropped_sensor(sens))
+        if CONF_COALESCED_UPDATES in stats:
+            sens = await sensor.new_sensor(stats[CONF_COALESCED_UPDATES])
+            cg.add(var.set_coalesced_sensor(sens))
+        if CONF_SUMMARY in stats:
+            sens = await text_sensor.new_text_sensor(stats[CONF_SUMMARY])
+            cg.add(var.set_stats_summary_sensor(sens))
 
     cg.add_library("ESPAsyncUDP", None)
@@ -0,0 +1,98 @@
+#include "lifx_color.h"
+
+namespace esphome {
+namespace lifx_emulation {
+
+// x / 255 for x <= 255 * 255 without a division
+static inline uint16_t div255(uint16_t x)
+{
+	return (x + 1 + (x >> 8)) >> 8;
+}
+
+void lifx_hsbk_to_rgb(const LifxHSBK *in, LifxRGB *out, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		// 768 step color wheel: red -> green -> blue -> red
+		uint16_t index = (uint16_t)(((uint32_t) in[i].hue * 768) >> 16);
+		uint16_t sector = index >> 8;
+		uint16_t rising = index & 0xff;
+		uint16_t falling = rising ^ 0xff;
+		uint16_t sat = in[i].saturation >> 8;
+		uint16_t bri = in[i].brightness >> 8;
+		uint16_t white = sat ^ 0xff;
+
+		uint16_t r = sector == 0 ? falling : sector == 2 ? rising : 0;
+		uint16_t g = sector == 0 ? rising : sector == 1 ? falling : 0;
+		uint16_t b = sector == 1 ? rising : sector == 2 ? falling : 0;
+
+		// Desaturate towards white, then scale by brightness
+		out[i].r = (uint8_t) div255((div255(r * sat) + white) * bri);
+		out[i].g = (uint8_t) div255((div255(g * sat) + white) * bri);
+		out[i].b = (uint8_t) div255((div255(b * sat) + white) * bri);
+	}
+}
+
+// Blackbody white points from 1500K to 9000K in 500K steps, brightest channel 65535
+static const uint16_t BLACKBODY_STEP = 500;
+static const uint16_t BLACKBODY_MIN = 1500;
+static const LifxRGB16 BLACKBODY[] = {
+	{65535, 27821, 0},     {65535, 35175, 3573},  {65535, 40880, 18008}, {65535, 45540, 28249},
+	{65535, 49481, 36192}, {65535, 52895, 42683}, {65535, 55906, 48171}, {65535, 58599, 52924},
+	{65535, 61036, 57117}, {65535, 63260, 60868}, {65535, 65306, 64261}, {62351, 62229, 65535},
+	{59073, 60353, 65535}, {56852, 59056, 65535}, {55187, 58069, 65535}, {53863, 57275, 65535},
+};
+static const size_t BLACKBODY_COUNT = sizeof(BLACKBODY) / sizeof(BLACKBODY[0]);
+
+// Per hue sector, which of {0, rising, falling, full} each of r, g, b takes
+static const uint8_t HUE_SECTOR[6][3] = {
+	{3, 1, 0}, {2, 3, 0}, {0, 3, 1}, {0, 2, 3}, {1, 0, 3}, {3, 0, 2},
+};
+
+void lifx_hsbk_to_rgb16(const LifxHSBK &in, LifxRGB16 &out)
+{
+	// Six hue sectors with a 16-bit position inside each
+	uint32_t h6 = (uint32_t) in.hue * 6;
+	const uint8_t *sector = HUE_SECTOR[h6 >> 16];
+	uint16_t rising = h6 & 0xffff;
+	const uint16_t ramp[4] = {0, rising, (uint16_t)(65535 - rising), 65535};
+	uint16_t r = ramp[sector[0]];
+	uint16_t g = ramp[sector[1]];
+	uint16_t b = ramp[sector[2]];
+	if (in.saturation == 65535)
+	{
+		out = {r, g, b};
+		return;
+	}
+
+	uint16_t kelvin = in.kelvin < BLACKBODY_MIN ? BLACKBODY_MIN : in.kelvin;
+	uint32_t step = (uint32_t)(kelvin - BLACKBODY_MIN) * 65536 / BLACKBODY_STEP;
+	size_t index = step >> 16;
+	LifxRGB16 white = BLACKBODY[BLACKBODY_COUNT - 1];
+	if (index < BLACKBODY_COUNT - 1)
+	{
+		uint32_t t = step & 0xffff;
+		white.r = lifx_lerp16(BLACKBODY[index].r, BLACKBODY[index + 1].r, t);
+		white.g = lifx_lerp16(BLACKBODY[index].g, BLACKBODY[index + 1].g, t);
+		white.b = lifx_lerp16(BLACKBODY[index].b, BLACKBODY[index + 1].b, t);
+	}
+	out.r = lifx_lerp16(white.r, r, in.saturation);
+	out.g = lifx_lerp16(white.g, g, in.saturation);
+	out.b = lifx_lerp16(white.b, b, in.saturation);
+}
+
+uint16_t lifx_kelvin_warm_share(uint16_t kelvin, float cold_mireds, float warm_mireds)
+{
+	if (kelvin == 0 || warm_mireds <= cold_mireds)
+		return 0;
+	// (1e6 / kelvin - cold) / (warm - cold) with a single division
+	float share = (1000000.0f - cold_mireds * kelvin) / ((warm_mireds - cold_mireds) * kelvin);
+	if (share <= 0.0f)
+		return 0;
+	if (share >= 1.0f)
+		return 65535;
+	return (uint16_t)(share * 65535.0f + 0.5f);
+}
+
+} // namespace lifx_emulation
+} // namespace esphome
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "lifx_protocol.h"
+
+namespace esphome {
+namespace lifx_emulation {
+
+struct LifxRGB {
+	uint8_t r, g, b;
+};
+
+struct LifxRGB16 {
+	uint16_t r, g, b;
+};
+
+// a + (b - a) * t / 65536 for t in 0..65536, without overflowing 32 bits
+inline uint16_t lifx_lerp16(uint16_t a, uint16_t b, uint32_t t)
+{
+	return (uint16_t)(((uint32_t) a * (65536 - t) + (uint32_t) b * t) >> 16);
+}
+
+// lifx_lerp16() for hues, the shortest way around the color wheel
+inline uint16_t lifx_lerp_hue16(uint16_t a, uint16_t b, uint32_t t)
+{
+	int32_t diff = (int32_t) b - (int32_t) a;
+	if (diff > 32767) diff -= 65536;
+	if (diff < -32768) diff += 65536;
+	return (uint16_t)((int32_t) a + diff * (int32_t) t / 65536);
+}
+
+// Converts count HSBK colors to 8-bit RGB, the same color wheel as hsb2rgb()
+// (kelvin is ignored). Fixed point and branch free so whole zone/tile frames
+// convert in one pass; the host build auto-vectorizes the loop.
+void lifx_hsbk_to_rgb(const LifxHSBK *in, LifxRGB *out, size_t count);
+
+// Full brightness 16-bit RGB for one color: six sector HSV hue, and
+// saturation below 100% mixes towards the blackbody white of kelvin (as real
+// bulbs do) rather than towards equal RGB. Brightness is left to the caller.
+void lifx_hsbk_to_rgb16(const LifxHSBK &in, LifxRGB16 &out);
+
+// Share of the warm white channel (0-65535) for kelvin on a light whose
+// cold/warm white channels sit at cold_mireds/warm_mireds, linear in mireds
+uint16_t lifx_kelvin_warm_share(uint16_t kelvin, float cold_mireds, float warm_mireds);
+
+// White channels of a single light, for showing precise_color whites. Read
+// from the light's traits once at setup: copying them per update may allocate.
+struct LifxWhiteTraits {
+	bool cold_warm;         // separate cold and warm white channels
+	bool color_temperature; // one tunable white
+	bool rgb;
+	bool white;             // a plain white channel next to RGB
+	float cold_mireds;
+	float warm_mireds;
+};
+
+} // namespace lifx_emulation
+} // namespace esphome
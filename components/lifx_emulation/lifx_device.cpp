@@ -0,0 +1,2048 @@
+#include "lifx_device.h"
+#include "lifx_utils.h"
+#include "lifx_tile_effect.h"
+#include "lifx_waveform.h"
+
+#include <algorithm>
+
+namespace esphome {
+namespace lifx_emulation {
+
+static const char *const TAG = "lifx_emulation";
+
+uint8_t LifxDevice::tx_buf_[LifxPacketSize + LIFX_MAX_RESPONSE_PAYLOAD];
+uint8_t LifxDevice::fast_tx_buf_[LifxPacketSize + LIFX_MAX_FAST_RESPONSE_PAYLOAD];
+
+void LifxDevice::export_state(LifxPersistentState &state) const
+{
+	memcpy(state.bulbLabel, bulbLabel, sizeof(bulbLabel));
+	memcpy(state.bulbLocation, bulbLocation, sizeof(bulbLocation));
+	memcpy(state.bulbLocationGUID, bulbLocationGUID, sizeof(bulbLocationGUID));
+	state.bulbLocationTime = bulbLocationTime;
+	memcpy(state.bulbGroup, bulbGroup, sizeof(bulbGroup));
+	memcpy(state.bulbGroupGUID, bulbGroupGUID, sizeof(bulbGroupGUID));
+	state.bulbGroupTime = bulbGroupTime;
+	state.cloudStatus = cloudStatus;
+	memcpy(state.cloudBrokerUrl, cloudBrokerUrl, sizeof(cloudBrokerUrl));
+	memcpy(state.cloudAuthResponse, cloudAuthResponse, sizeof(cloudAuthResponse));
+	memcpy(state.authResponse, authResponse, sizeof(authResponse));
+}
+
+void LifxDevice::import_state(const LifxPersistentState &state, bool restore_identity)
+{
+	cloudStatus = state.cloudStatus;
+	memcpy(cloudBrokerUrl, state.cloudBrokerUrl, sizeof(cloudBrokerUrl));
+	memcpy(cloudAuthResponse, state.cloudAuthResponse, sizeof(cloudAuthResponse));
+	memcpy(authResponse, state.authResponse, sizeof(authResponse));
+
+	if (restore_identity) {
+		memcpy(bulbLabel, state.bulbLabel, sizeof(bulbLabel));
+		memcpy(bulbLocation, state.bulbLocation, sizeof(bulbLocation));
+		memcpy(bulbLocationGUID, state.bulbLocationGUID, sizeof(bulbLocationGUID));
+		bulbLocationTime = state.bulbLocationTime;
+		memcpy(bulbGroup, state.bulbGroup, sizeof(bulbGroup));
+		memcpy(bulbGroupGUID, state.bulbGroupGUID, sizeof(bulbGroupGUID));
+		bulbGroupTime = state.bulbGroupTime;
+	}
+	light_version_++;
+	identity_version_++;
+}
+
+// Setters arrive in bursts while the app onboards a bulb; restart the quiet
+// period on each one and let loop() write the final state once.
+void LifxDevice::save_state_()
+{
+	save_requests_++;
+	save_pending_ = true;
+	save_requested_at_ = clock_->millis();
+}
+
+// Exports into `state` and hashes it; padding is zeroed so the hash is stable
+uint32_t LifxDevice::state_hash_(LifxPersistentState &state) const
+{
+	memset(&state, 0, sizeof(state));
+	export_state(state);
+	return fnv1a_hash(&state, sizeof(state));
+}
+
+void LifxDevice::flush_state()
+{
+	if (!save_pending_)
+		return;
+	save_pending_ = false;
+
+	LifxPersistentState state;
+	uint32_t hash = state_hash_(state);
+	if (hash == saved_hash_)
+	{
+		// e.g. the app re-sent the label we already have
+		save_unchanged_++;
+		if (debug_) ESP_LOGD(TAG, "State unchanged, skipping flash write");
+		return;
+	}
+	{
+		LifxLatencyScope timing(latency_[LATENCY_SAVE], clock_);
+		storage_->save(state);
+	}
+	saved_hash_ = hash;
+	save_writes_++;
+	if (debug_) ESP_LOGD(TAG, "Saved state: label=%s, location=%s (%s), group=%s (%s)",
+		bulbLabel, bulbLocation, bulbLocationGUID, bulbGroup, bulbGroupGUID);
+}
+
+// Current time as real bulbs report it: nanosecond epoch (msec * 1,000,000 + magic)
+uint64_t LifxDevice::lifx_timestamp_()
+{
+	return (uint64_t)((clock_->utc_seconds() * 1000) * 1000000 + LifxMagicNum);
+}
+
+void LifxDevice::begin()
+{
+	if (debug_) ESP_LOGD(TAG, "Setting Light Name: %s", bulbLabel);
+
+	// Convert incoming guid strings to byte arrays (strips dashes)
+	hexCharacterStringToBytes(bulbGroupGUIDb, (const char *)bulbGroupGUID);
+	hexCharacterStringToBytes(bulbLocationGUIDb, (const char *)bulbLocationGUID);
+
+	// YAML setters and import_state() ran before begin()
+	light_version_++;
+	identity_version_++;
+	tx_timestamp_ = lifx_timestamp_();
+	publish_snapshot_();
+
+	trace_.init((trace_size_ + TRACE_LANES - 1) / TRACE_LANES);
+
+	if (zone_count_)
+	{
+		zones_ = new LifxHSBK[zone_count_]();
+		zones_applied_ = new LifxHSBK[zone_count_]();
+	}
+	else if (get_tile_pixels())
+	{
+		tile_fb_ = new LifxHSBK[tile_fb_count_ * get_tile_pixels()]();
+	}
+
+	// Whatever was restored (or the YAML defaults) counts as already saved
+	LifxPersistentState state;
+	saved_hash_ = state_hash_(state);
+
+	flushLight(); // sync initial light state
+}
+
+void LifxDevice::handle_datagram(const uint8_t *data, uint32_t len, const LifxPeer &peer)
+{
+	uint32_t start = clock_->micros();
+	LifxTraceEvent event = receive_(data, len, peer);
+	uint32_t elapsed = clock_->micros() - start;
+	latency_[LATENCY_RECEIVE].record(elapsed);
+	if (event && trace_.enabled())
+		trace_.record(TRACE_LANE_NETWORK, event, start, elapsed, data, len);
+}
+
+// What happened to the frame, for the trace; 0 for frames that are not ours
+LifxTraceEvent LifxDevice::receive_(const uint8_t *data, uint32_t len, const LifxPeer &peer)
+{
+	rx_bytes += len;
+
+	if (len < LifxPacketSize) {
+		if (debug_) ESP_LOGD(TAG, "Runt packet (%u bytes), ignoring", (unsigned) len);
+		return (LifxTraceEvent) 0;
+	}
+	// Peek at the frame addressing before paying for the copy and full decode
+	if (!is_addressed_to_us_(data)) {
+		rx_not_for_us++;
+		return (LifxTraceEvent) 0;
+	}
+	rx_family_[lifx_packet_family(data[32] | (data[33] << 8))]++;
+	if (len > LIFX_MAX_PACKET_LENGTH) {
+		ESP_LOGW(TAG, "Packet too large (%u bytes), ignoring", (unsigned) len);
+		return TRACE_DROPPED;
+	}
+
+	// Handlers read the datagram in place; nothing is copied
+	LifxPacketView request(data, len);
+	LifxFrameQueue *queue = rx_queue_();
+	if (!queue)
+	{
+		handleRequest(request, peer);
+		return TRACE_INLINE;
+	}
+
+	// Pure GETs are answered right here from the published snapshot, but only
+	// when nothing is queued ahead of them so replies never overtake a SET.
+	int index = find_dispatch_entry(request.type());
+	if (index >= 0 && (DISPATCH_TABLE[index].flags & (LIFX_DISPATCH_FAST | LIFX_DISPATCH_IGNORED)) &&
+		queue->empty() && answer_fast_(index, request, peer))
+		return TRACE_FAST;
+
+	// Everything else is copied out and handled by loop() on the main task
+	if (!queue->push(data, len, peer, set_index_))
+	{
+		rx_queue_dropped_++;
+		if (log_packets_()) ESP_LOGD(TAG, "Rx queue full, dropping %s", lifx_packet_type_name(request.type()));
+		return TRACE_DROPPED;
+	}
+	return TRACE_QUEUED;
+}
+
+// Tagged frames (and untagged ones with an all-zero target, which some clients
+// send for discovery) are for every bulb; anything else must match our MAC.
+bool LifxDevice::is_addressed_to_us_(const uint8_t *data) const
+{
+	uint16_t protocol = data[2] | (data[3] << 8);
+	if (protocol & LifxProtocol_Tagged)
+		return true;
+	const uint8_t *target = data + 8;
+	if (memcmp(target, mac, sizeof(mac)) == 0)
+		return true;
+	static const uint8_t broadcast[6] = {};
+	return memcmp(target, broadcast, sizeof(broadcast)) == 0;
+}
+
+void lifx_virtual_mac(const uint8_t *base, uint8_t index, uint8_t *out)
+{
+	memcpy(out, base, 6);
+	if (index == 0)
+		return;
+	out[0] |= 0x02;
+	// Add to the device specific half with carry, so a base ending in 0xFF
+	// does not wrap onto a sibling's address
+	uint32_t low = ((uint32_t) out[3] << 16 | out[4] << 8 | out[5]) + index;
+	out[3] = low >> 16;
+	out[4] = low >> 8;
+	out[5] = low;
+}
+
+bool LifxDeviceSet::add(LifxDevice *device)
+{
+	uint8_t count = count_.load(std::memory_order_relaxed);
+	if (count >= LIFX_MAX_VIRTUAL_DEVICES)
+		return false;
+	// Nothing pushes before the first device is published below
+	if (count == 0)
+	{
+		rx_queue_size_ = device->rx_queue_size_;
+		rx_queue_.init(rx_queue_size_ * LIFX_QUEUE_BYTES_PER_FRAME);
+	}
+	device->set_ = this;
+	device->set_index_ = count;
+	devices_[count] = device;
+	count_.store(count + 1, std::memory_order_release);
+	return true;
+}
+
+LifxDevice *LifxDeviceSet::handle_datagram(const uint8_t *data, uint32_t len, const LifxPeer &peer)
+{
+	uint8_t count = size();
+	if (count == 0)
+		return nullptr;
+
+	// Runts and frames for nobody here are still counted, by the first device
+	if (len >= LifxPacketSize)
+	{
+		uint16_t protocol = data[2] | (data[3] << 8);
+		const uint8_t *target = data + 8;
+		static const uint8_t broadcast[6] = {};
+		if ((protocol & LifxProtocol_Tagged) || memcmp(target, broadcast, sizeof(broadcast)) == 0)
+		{
+			for (uint8_t i = 0; i < count; i++)
+				devices_[i]->handle_datagram(data, len, peer);
+			return devices_[0];
+		}
+		for (uint8_t i = 0; i < count; i++)
+		{
+			if (memcmp(target, devices_[i]->get_mac(), 6) == 0)
+			{
+				devices_[i]->handle_datagram(data, len, peer);
+				return devices_[i];
+			}
+		}
+	}
+	devices_[0]->handle_datagram(data, len, peer);
+	return devices_[0];
+}
+
+void LifxDeviceSet::drain()
+{
+	for (size_t i = 0; i < rx_queue_size_; i++)
+	{
+		const LifxQueuedFrame *frame = rx_queue_.front();
+		if (!frame)
+			break;
+		LifxPacketView request(frame->data(), frame->len);
+		devices_[frame->device]->handleRequest(request, frame->peer);
+		rx_queue_.pop();
+	}
+}
+
+void LifxDevice::log_short_payload_(const LifxPacketView &request)
+{
+	ESP_LOGW(TAG, "%s with short payload (%u bytes), ignoring",
+		lifx_packet_type_name(request.type()), (unsigned) request.payload_size());
+}
+
+// ============================================================================
+// Dispatch table
+//
+// One entry per message type, sorted by type for binary search. `apply`
+// mutates device state (may be null for pure GETs), `encode` writes the
+// response payload. For LIFX_DISPATCH_MUTATES entries the response is only
+// sent when the client set res_required; for everything else it is always
+// sent. Payloads shorter than min_payload are rejected before apply runs.
+// LIFX_FAST entries only read the state snapshot, so handle_datagram() may
+// answer them straight from the UDP callback.
+// ============================================================================
+
+#define LIFX_SET(type, payload, apply, encode, response) \
+	{type, payload, &LifxDevice::apply, encode, response, LIFX_DISPATCH_MUTATES}
+#define LIFX_GET(type, encode, response) \
+	{type, 0, nullptr, &LifxDevice::encode, response, 0}
+#define LIFX_FAST(type, encode, response) \
+	{type, 0, nullptr, &LifxDevice::encode, response, LIFX_DISPATCH_FAST}
+// GETs whose handler sends its own (possibly several) responses
+#define LIFX_MULTI(type, handler) \
+	{type, 0, &LifxDevice::handler, nullptr, 0, 0}
+#define LIFX_IGNORE(type) \
+	{type, 0, nullptr, nullptr, 0, LIFX_DISPATCH_IGNORED}
+
+constexpr LifxDispatchEntry LifxDevice::DISPATCH_TABLE[] = {
+	LIFX_FAST(GET_PAN_GATEWAY, encode_service_, PAN_GATEWAY),
+	LIFX_IGNORE(PAN_GATEWAY),
+	LIFX_FAST(GET_MESH_FIRMWARE_STATE, encode_host_firmware_, MESH_FIRMWARE_STATE),
+	LIFX_IGNORE(MESH_FIRMWARE_STATE),
+	LIFX_GET(GET_WIFI_INFO, encode_wifi_info_, WIFI_INFO),
+	LIFX_FAST(GET_WIFI_FIRMWARE_STATE, encode_wifi_firmware_, WIFI_FIRMWARE_STATE),
+	LIFX_IGNORE(WIFI_FIRMWARE_STATE),
+	LIFX_FAST(GET_POWER_STATE, encode_power_, POWER_STATE),
+	LIFX_SET(SET_POWER_STATE, sizeof(LifxPayloadPower), apply_power_, &LifxDevice::encode_power_, POWER_STATE),
+	LIFX_FAST(GET_BULB_LABEL, encode_label_, BULB_LABEL),
+	LIFX_SET(SET_BULB_LABEL, sizeof(LifxPayloadLabel), apply_label_, &LifxDevice::encode_label_, BULB_LABEL),
+	LIFX_IGNORE(BULB_LABEL),
+	LIFX_GET(GET_BULB_TAGS, encode_tags_, BULB_TAGS),
+	LIFX_SET(SET_BULB_TAGS, LifxBulbTagsLength, apply_tags_, &LifxDevice::encode_tags_, BULB_TAGS),
+	LIFX_GET(GET_BULB_TAG_LABELS, encode_tag_labels_, BULB_TAG_LABELS),
+	LIFX_SET(SET_BULB_TAG_LABELS, LifxBulbTagLabelsLength, apply_tag_labels_, &LifxDevice::encode_tag_labels_, BULB_TAG_LABELS),
+	LIFX_FAST(GET_VERSION_STATE, encode_version_, VERSION_STATE),
+	LIFX_IGNORE(VERSION_STATE),
+	LIFX_IGNORE(STATE_INFO),
+	LIFX_FAST(GET_LOCATION_STATE, encode_location_, LOCATION_STATE),
+	LIFX_SET(SET_LOCATION_STATE, sizeof(LifxPayloadLocation), apply_location_, &LifxDevice::encode_location_, LOCATION_STATE),
+	LIFX_IGNORE(LOCATION_STATE),
+	LIFX_FAST(GET_GROUP_STATE, encode_group_, GROUP_STATE),
+	LIFX_SET(SET_GROUP_STATE, sizeof(LifxPayloadGroup), apply_group_, &LifxDevice::encode_group_, GROUP_STATE),
+	LIFX_IGNORE(GROUP_STATE),
+	LIFX_GET(GET_AUTH_STATE, encode_auth_, AUTH_STATE),
+	LIFX_SET(SET_AUTH_STATE, 0, apply_auth_, &LifxDevice::encode_auth_, AUTH_STATE),
+	LIFX_IGNORE(AUTH_STATE),
+	LIFX_FAST(ECHO_REQUEST, encode_echo_, ECHO_RESPONSE),
+	LIFX_FAST(GET_LIGHT_STATE, encode_light_state_, LIGHT_STATUS),
+	LIFX_SET(SET_LIGHT_STATE, sizeof(LifxPayloadSetColor), apply_color_, &LifxDevice::encode_light_state_, LIGHT_STATUS),
+	LIFX_SET(SET_WAVEFORM, sizeof(LifxPayloadSetWaveform), apply_waveform_, &LifxDevice::encode_light_state_, LIGHT_STATUS),
+	LIFX_IGNORE(LIGHT_STATUS),
+	// Real bulbs answer LightGetPower with StatePower(22); kept for HA compatibility
+	LIFX_FAST(GET_POWER_STATE2, encode_power_, POWER_STATE),
+	LIFX_SET(SET_POWER_STATE2, sizeof(LifxPayloadPower), apply_power_, &LifxDevice::encode_power_, POWER_STATE2),
+	LIFX_SET(SET_WAVEFORM_OPTIONAL, sizeof(LifxPayloadSetWaveformOptional), apply_waveform_optional_, &LifxDevice::encode_light_state_, LIGHT_STATUS),
+	LIFX_GET(GET_CLOUD_STATE, encode_cloud_state_, CLOUD_STATE),
+	LIFX_SET(SET_CLOUD_STATE, sizeof(cloudStatus), apply_cloud_state_, nullptr, 0),
+	LIFX_GET(GET_CLOUD_AUTH, encode_cloud_auth_, CLOUD_AUTH_STATE),
+	LIFX_SET(SET_CLOUD_AUTH, 0, apply_cloud_auth_, &LifxDevice::encode_cloud_auth_, CLOUD_AUTH_STATE),
+	LIFX_GET(GET_CLOUD_BROKER, encode_cloud_broker_, CLOUD_BROKER_STATE),
+	LIFX_SET(SET_CLOUD_BROKER, 0, apply_cloud_broker_, &LifxDevice::encode_cloud_broker_, CLOUD_BROKER_STATE),
+	LIFX_SET(SET_COLOR_ZONES, sizeof(LifxPayloadSetColorZones), apply_color_zones_, nullptr, 0),
+	LIFX_MULTI(GET_COLOR_ZONE, send_color_zones_),
+	LIFX_IGNORE(STATE_COLOR_ZONE),
+	LIFX_IGNORE(STATE_MULTI_ZONE),
+	LIFX_GET(GET_MULTI_ZONE_EFFECT, encode_zone_effect_, STATE_MULTI_ZONE_EFFECT),
+	LIFX_SET(SET_MULTI_ZONE_EFFECT, sizeof(LifxPayloadMultiZoneEffect), apply_zone_effect_, &LifxDevice::encode_zone_effect_, STATE_MULTI_ZONE_EFFECT),
+	LIFX_IGNORE(STATE_MULTI_ZONE_EFFECT),
+	LIFX_SET(SET_EXT_COLOR_ZONES, offsetof(LifxPayloadSetExtColorZones, colors), apply_ext_color_zones_, nullptr, 0),
+	LIFX_MULTI(GET_EXT_COLOR_ZONES, send_ext_color_zones_),
+	LIFX_IGNORE(STATE_EXT_COLOR_ZONES),
+	LIFX_MULTI(GET_DEVICE_CHAIN, send_device_chain_),
+	LIFX_IGNORE(STATE_DEVICE_CHAIN),
+	LIFX_SET(SET_USER_POSITION, sizeof(LifxPayloadSetUserPosition), apply_user_position_, nullptr, 0),
+	LIFX_MULTI(GET_TILE_STATE64, send_tile_state64_),
+	LIFX_IGNORE(STATE_TILE_STATE64),
+	LIFX_SET(SET_TILE_STATE64, offsetof(LifxPayloadSet64, colors), apply_tile_state64_, nullptr, 0),
+	LIFX_SET(SET_TILE_BUFFER_COPY, sizeof(LifxPayloadCopyFrameBuffer), apply_copy_frame_buffer_, nullptr, 0),
+	LIFX_MULTI(GET_TILE_EFFECT, send_tile_effect_),
+	LIFX_SET(SET_TILE_EFFECT, offsetof(LifxPayloadSetTileEffect, settings) + offsetof(LifxTileEffectSettings, palette),
+		apply_tile_effect_, nullptr, 0),
+	LIFX_IGNORE(STATE_TILE_EFFECT),
+	LIFX_MULTI(GET_TRACE, send_trace_),
+};
+
+#undef LIFX_SET
+#undef LIFX_GET
+#undef LIFX_FAST
+#undef LIFX_MULTI
+#undef LIFX_IGNORE
+
+const size_t LifxDevice::DISPATCH_TABLE_SIZE = sizeof(DISPATCH_TABLE) / sizeof(DISPATCH_TABLE[0]);
+
+static constexpr bool dispatch_table_sorted(const LifxDispatchEntry *table, size_t n)
+{
+	for (size_t i = 1; i < n; i++)
+		if (table[i - 1].type >= table[i].type)
+			return false;
+	return true;
+}
+static_assert(dispatch_table_sorted(LifxDevice::DISPATCH_TABLE, sizeof(LifxDevice::DISPATCH_TABLE) / sizeof(LifxDispatchEntry)),
+	"DISPATCH_TABLE must be sorted by message type without duplicates");
+static_assert(sizeof(LifxDevice::DISPATCH_TABLE) / sizeof(LifxDispatchEntry) <= LIFX_DISPATCH_MAX_ENTRIES,
+	"raise LIFX_DISPATCH_MAX_ENTRIES");
+
+int LifxDevice::find_dispatch_entry(uint16_t type)
+{
+	size_t lo = 0, hi = DISPATCH_TABLE_SIZE;
+	while (lo < hi)
+	{
+		size_t mid = (lo + hi) / 2;
+		if (DISPATCH_TABLE[mid].type < type)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo < DISPATCH_TABLE_SIZE && DISPATCH_TABLE[lo].type == type) ? (int) lo : -1;
+}
+
+void LifxDevice::handleRequest(const LifxPacketView &request, const LifxPeer &peer)
+{
+	uint32_t start = clock_->micros();
+	dispatch_(request, peer);
+	uint32_t elapsed = clock_->micros() - start;
+	latency_[LATENCY_DISPATCH].record(elapsed);
+	if (trace_.enabled())
+		trace_.record(rx_queue_() ? TRACE_LANE_LOOP : TRACE_LANE_NETWORK, TRACE_DISPATCH, start, elapsed,
+			reinterpret_cast<const uint8_t *>(&request.header()), LifxPacketSize + request.payload_size());
+}
+
+void LifxDevice::dispatch_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	uint16_t packet_type = request.type();
+	if (log_packets_()) ESP_LOGD(TAG, "-> %s (0x%02X/%d)", lifx_packet_type_name(packet_type), packet_type, packet_type);
+
+	LifxPacket response;
+	init_response_(response, request, tx_buf_, tx_timestamp_);
+
+	int index = find_dispatch_entry(packet_type);
+	if (index < 0)
+	{
+		dispatch_unknown_++;
+		ESP_LOGW(TAG, "Unknown packet type: %s (0x%02X/%d)", lifx_packet_type_name(packet_type), packet_type, packet_type);
+	}
+	else
+	{
+		const LifxDispatchEntry &entry = DISPATCH_TABLE[index];
+		dispatch_hits_[index]++;
+
+		if (entry.flags & LIFX_DISPATCH_IGNORED)
+		{
+			// Ignore response packets from other bulbs
+			if (debug_) ESP_LOGD(TAG, "Ignoring bulb response packet");
+		}
+		else if (request.payload_size() < entry.min_payload)
+		{
+			dispatch_short_++;
+			log_short_payload_(request);
+		}
+		else if (entry.type == GET_PAN_GATEWAY && defer_discovery_(request, peer))
+		{
+			// Answered (and acknowledged) by loop() once its jitter has passed
+			return;
+		}
+		else
+		{
+			LifxSourceHistory *history = nullptr;
+			bool replayed = (entry.flags & LIFX_DISPATCH_MUTATES) && replayed_(request, history);
+			if (entry.apply && !replayed)
+			{
+				(this->*entry.apply)(request, peer);
+				publish_snapshot_();
+			}
+			uint32_t sent = replayed && history ? resend_response_(*history, request, response, peer) : 0;
+			if (!sent)
+			{
+				// The main loop is the only snapshot writer, so it can read it directly
+				sent = respond_(entry, request, snapshot_, response, peer);
+				if (history && !replayed)
+					cache_response_(*history, request, sent ? &response : nullptr);
+			}
+			tx_bytes += sent;
+		}
+	}
+
+	tx_bytes += acknowledge_(request, response, peer);
+}
+
+// True for a SET already handled (a retransmission) or one just overtaken
+// by a newer color/power change from the same client; either way the
+// caller skips apply and only answers it again. history is set to the
+// client's slot. Source 0 is not tracked, clients using it may not number
+// their frames at all.
+bool LifxDevice::replayed_(const LifxPacketView &request, LifxSourceHistory *&history)
+{
+	uint32_t source;
+	memcpy(&source, request.source(), sizeof(source));
+	if (source == 0)
+		return false;
+
+	uint32_t now = clock_->millis();
+	LifxSourceHistory *victim = &sources_[0];
+	history = nullptr;
+	for (LifxSourceHistory &slot : sources_)
+	{
+		if (slot.source == source)
+		{
+			if (now - slot.last_ms < LIFX_SEQUENCE_EXPIRE_MS)
+				history = &slot;
+			else
+				victim = &slot;
+			break;
+		}
+		// Prefer a free slot, then the least recently used one
+		if (victim->source != 0 && (slot.source == 0 || (int32_t)(slot.last_ms - victim->last_ms) < 0))
+			victim = &slot;
+	}
+	if (history == nullptr)
+	{
+		history = victim;
+		*history = {};
+		history->source = source;
+	}
+	history->last_ms = now;
+
+	uint8_t sequence = request.sequence();
+	uint16_t type = request.type();
+	uint32_t hash = fnv1a_hash(request.payload(), request.payload_size());
+	uint8_t slot = LIFX_SEQUENCE_RECENT;
+	for (uint8_t i = 0; i < history->recent_count; i++)
+	{
+		if (history->recent[i].sequence != sequence)
+			continue;
+		if (history->recent[i].type == type && history->recent[i].payload_hash == hash)
+		{
+			rx_duplicates_++;
+			if (debug_) ESP_LOGD(TAG, "Duplicate %s seq %u, not applied", lifx_packet_type_name(type), sequence);
+			return true;
+		}
+		// Same sequence, different frame: the client reuses its numbers
+		slot = i;
+		break;
+	}
+	if (slot == LIFX_SEQUENCE_RECENT)
+	{
+		slot = history->recent_next;
+		history->recent_next = (history->recent_next + 1) % LIFX_SEQUENCE_RECENT;
+		if (history->recent_count < LIFX_SEQUENCE_RECENT)
+			history->recent_count++;
+	}
+	history->recent[slot].sequence = sequence;
+	history->recent[slot].type = type;
+	history->recent[slot].payload_hash = hash;
+
+	uint8_t kind = (type == SET_LIGHT_STATE || type == SET_WAVEFORM || type == SET_WAVEFORM_OPTIONAL) ? LIFX_HISTORY_COLOR :
+		(type == SET_POWER_STATE || type == SET_POWER_STATE2) ? LIFX_HISTORY_POWER : 0;
+	if (!kind)
+		return false;
+	uint8_t &last = kind == LIFX_HISTORY_COLOR ? history->color_seq : history->power_seq;
+	uint32_t &last_ms = kind == LIFX_HISTORY_COLOR ? history->color_ms : history->power_ms;
+	uint8_t behind = last - sequence;
+	if ((history->valid & kind) && behind != 0 && behind < LIFX_SEQUENCE_REORDER_WINDOW &&
+		now - last_ms < LIFX_SEQUENCE_REORDER_MS)
+	{
+		rx_stale_++;
+		if (debug_) ESP_LOGD(TAG, "Stale %s seq %u (seq %u applied), not applied", lifx_packet_type_name(type), sequence, last);
+		return true;
+	}
+	last = sequence;
+	last_ms = now;
+	history->valid |= kind;
+	return false;
+}
+
+// Remembers the answer to an applied SET (null: it got none) for resend_response_()
+void LifxDevice::cache_response_(LifxSourceHistory &history, const LifxPacketView &request, const LifxPacket *response)
+{
+	history.response_to = 0;
+	if (!response || response->data_size > (int) sizeof(history.response))
+		return;
+	history.response_to = request.type();
+	history.response_sequence = request.sequence();
+	history.response_type = response->packet_type;
+	history.response_size = response->data_size;
+	memcpy(history.response, response->data, response->data_size);
+}
+
+// Answers a retransmission with the cached response; 0 when there is none
+// for it (SET not cached, or the client sent newer ones since)
+uint32_t LifxDevice::resend_response_(const LifxSourceHistory &history, const LifxPacketView &request,
+	LifxPacket &response, const LifxPeer &peer)
+{
+	if (!(request.res_ack() & RES_REQUIRED) || history.response_to != request.type() ||
+		history.response_sequence != request.sequence())
+		return 0;
+	response.packet_type = history.response_type;
+	response.protocol = LifxProtocol_AllBulbsResponse;
+	memcpy(response.data, history.response, history.response_size);
+	response.data_size = history.response_size;
+	return sendPacket(response, peer);
+}
+
+// Runs in the UDP callback. Returns false if loop() kept the snapshot busy,
+// in which case the caller queues the frame instead.
+bool LifxDevice::answer_fast_(int index, const LifxPacketView &request, const LifxPeer &peer)
+{
+	LifxStateSnapshot state;
+	if (!read_snapshot_(state))
+		return false;
+
+	const LifxDispatchEntry &entry = DISPATCH_TABLE[index];
+	// Jittered discovery replies are scheduled by loop()
+	if (entry.type == GET_PAN_GATEWAY && discovery_jitter_ms_)
+		return false;
+	if (log_packets_()) ESP_LOGD(TAG, "-> %s (fast)", lifx_packet_type_name(entry.type));
+	rx_fast_++;
+	fast_dispatch_hits_[index]++;
+
+	LifxPacket response;
+	init_response_(response, request, fast_tx_buf_, state.timestamp);
+	if (!(entry.flags & LIFX_DISPATCH_IGNORED))
+		tx_bytes_fast_ += respond_(entry, request, state, response, peer);
+	tx_bytes_fast_ += acknowledge_(request, response, peer);
+	return true;
+}
+
+void LifxDevice::init_response_(LifxPacket &response, const LifxPacketView &request, uint8_t *frame, uint64_t timestamp)
+{
+	response.data = frame + LifxPacketSize;
+	memcpy(response.source, request.source(), sizeof(response.source));
+	// Bulbs must respond with matching sequence number from request
+	response.sequence = request.sequence();
+	response.res_ack = NO_RESPONSE;
+	response.protocol = LifxProtocol_AllBulbsResponse;
+	response.timestamp = timestamp;
+}
+
+uint32_t LifxDevice::respond_(const LifxDispatchEntry &entry, const LifxPacketView &request,
+	const LifxStateSnapshot &state, LifxPacket &response, const LifxPeer &peer)
+{
+	bool respond = entry.encode &&
+		(!(entry.flags & LIFX_DISPATCH_MUTATES) || (request.res_ack() & RES_REQUIRED));
+	if (!respond)
+		return 0;
+
+	response.packet_type = entry.response_type;
+	response.protocol = LifxProtocol_AllBulbsResponse;
+	response.data_size = (this->*entry.encode)(request, state, response.data);
+	uint32_t sent = sendPacket(response, peer);
+
+	if (entry.type == GET_PAN_GATEWAY)
+	{
+		// A real bulb responds twice, once as service type 5
+		reinterpret_cast<LifxPayloadStateService *>(response.data)->service = SERVICE_UDP5;
+		sent += sendPacket(response, peer);
+	}
+	return sent;
+}
+
+// Runs on the main task. Returns false to answer right away: jitter off,
+// no rx queue (the callback would race loop()) or every slot taken.
+bool LifxDevice::defer_discovery_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	if (!discovery_jitter_ms_ || !rx_queue_())
+		return false;
+	for (PendingDiscovery &slot : discovery_)
+	{
+		if (slot.active)
+			continue;
+		// Hash our MAC and the request, so bulbs (even with nearly equal MACs)
+		// land apart and each new discovery round reshuffles them
+		uint8_t key[sizeof(mac) + 4 + 1];
+		memcpy(key, mac, sizeof(mac));
+		memcpy(key + sizeof(mac), request.source(), 4);
+		key[sizeof(mac) + 4] = request.sequence();
+		uint32_t h = fnv1a_hash(key, sizeof(key));
+
+		slot.active = true;
+		slot.due = clock_->millis() + h % (discovery_jitter_ms_ + 1);
+		slot.peer = peer;
+		memcpy(slot.header, &request.header(), LifxPacketSize);
+		discovery_pending_++;
+		discovery_deferred_++;
+		return true;
+	}
+	return false;
+}
+
+void LifxDevice::send_due_discovery_()
+{
+	uint32_t now = clock_->millis();
+	for (PendingDiscovery &slot : discovery_)
+	{
+		if (!slot.active || (int32_t)(now - slot.due) < 0)
+			continue;
+		slot.active = false;
+		discovery_pending_--;
+		discovery_sent_++;
+
+		LifxPacketView request(slot.header, LifxPacketSize);
+		LifxPacket response;
+		init_response_(response, request, tx_buf_, tx_timestamp_);
+		tx_bytes += respond_(DISPATCH_TABLE[find_dispatch_entry(GET_PAN_GATEWAY)], request, snapshot_, response, slot.peer);
+		tx_bytes += acknowledge_(request, response, slot.peer);
+	}
+}
+
+// Handle ack_required (bit 1) - send Acknowledgement(45) independently of res_required
+// Per the LIFX spec, res_required (bit 0) and ack_required (bit 1) are independent flags.
+uint32_t LifxDevice::acknowledge_(const LifxPacketView &request, LifxPacket &response, const LifxPeer &peer)
+{
+	uint8_t res_ack = request.res_ack();
+
+	// Log non-standard flag bits (observed from real devices, bits 2+ are reserved per spec)
+	if (res_ack & PAN_REQUIRED)
+	{
+		if (debug_) ESP_LOGD(TAG, "PAN flag set (0x%02X)", res_ack);
+	}
+
+	if (!(res_ack & ACK_REQUIRED))
+		return 0;
+	if (debug_) ESP_LOGD(TAG, "Acknowledgement Requested");
+	response.packet_type = ACKNOWLEDGEMENT;
+	response.res_ack = NO_RESPONSE;
+	response.protocol = LifxProtocol_AllBulbsResponse;
+	response.data_size = 0;
+	return sendPacket(response, peer);
+}
+
+// Seqlock writer: an odd sequence number marks the copy as in progress
+void LifxDevice::publish_snapshot_()
+{
+	// Most loop ticks change nothing; skip the write so readers never retry
+	if (snapshot_.light_version == light_version_ && snapshot_.identity_version == identity_version_ &&
+		snapshot_.timestamp == tx_timestamp_)
+		return;
+
+	uint32_t seq = snapshot_seq_.load(std::memory_order_relaxed);
+	snapshot_seq_.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	snapshot_.timestamp = tx_timestamp_;
+	if (snapshot_.light_version != light_version_)
+	{
+		buildLightStateData(reinterpret_cast<byte *>(&snapshot_.light_state));
+		snapshot_.power.level = power_status;
+		memcpy(snapshot_.label.label, bulbLabel, sizeof(snapshot_.label.label));
+		snapshot_.light_version = light_version_;
+		snapshot_encodes_++;
+	}
+	if (snapshot_.identity_version != identity_version_)
+	{
+		for (size_t i = 0; i < sizeof(bulbLocationGUIDb); i++)
+		{
+			snapshot_.location.location[i] = bulbLocationGUIDb[guidSeq[i]];
+			snapshot_.group.group[i] = bulbGroupGUIDb[guidSeq[i]];
+		}
+		memcpy(snapshot_.location.label, bulbLocation, sizeof(bulbLocation));
+		snapshot_.location.updated_at = bulbLocationTime;
+		memcpy(snapshot_.group.label, bulbGroup, sizeof(bulbGroup));
+		snapshot_.group.updated_at = bulbGroupTime;
+		snapshot_.identity_version = identity_version_;
+		snapshot_encodes_++;
+	}
+
+	snapshot_seq_.store(seq + 2, std::memory_order_release);
+}
+
+bool LifxDevice::read_snapshot_(LifxStateSnapshot &out) const
+{
+	for (int attempt = 0; attempt < 4; attempt++)
+	{
+		uint32_t before = snapshot_seq_.load(std::memory_order_acquire);
+		if (before & 1)
+			continue;
+		memcpy(&out, &snapshot_, sizeof(out));
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (snapshot_seq_.load(std::memory_order_relaxed) == before)
+			return true;
+	}
+	return false;
+}
+
+void LifxDevice::log_dispatch_stats()
+{
+	for (size_t i = 0; i < DISPATCH_TABLE_SIZE; i++)
+	{
+		uint32_t hits = get_dispatch_hits(i);
+		if (hits)
+			ESP_LOGI(TAG, "%-26s %8u", lifx_packet_type_name(DISPATCH_TABLE[i].type), (unsigned) hits);
+	}
+	ESP_LOGI(TAG, "unknown: %u, short payload: %u", (unsigned) dispatch_unknown_, (unsigned) dispatch_short_);
+	ESP_LOGI(TAG, "light updates applied: %u, coalesced: %u", (unsigned) light_applied_, (unsigned) light_coalesced_);
+	ESP_LOGI(TAG, "answered in callback: %u, rx queue drops: %u", (unsigned) rx_fast_, (unsigned) rx_queue_dropped_);
+	ESP_LOGI(TAG, "repeated SETs not applied: %u duplicate, %u stale", (unsigned) rx_duplicates_, (unsigned) rx_stale_);
+	ESP_LOGI(TAG, "state saves requested: %u, written: %u, unchanged: %u",
+		(unsigned) save_requests_, (unsigned) save_writes_, (unsigned) save_unchanged_);
+	ESP_LOGI(TAG, "transition frames: %u", (unsigned) transition_frames_);
+	static const char *const STAGES[LATENCY_STAGES] = {"receive", "dispatch", "light", "save", "send"};
+	for (int i = 0; i < LATENCY_STAGES; i++)
+	{
+		uint32_t counts[LIFX_LATENCY_BUCKETS];
+		latency_[i].read(counts);
+		ESP_LOGI(TAG, "%-8s p50 < %u us, p99 < %u us", STAGES[i],
+			(unsigned) lifx_latency_percentile(counts, 50) + 1, (unsigned) lifx_latency_percentile(counts, 99) + 1);
+	}
+	ESP_LOGI(TAG, "discovery replies deferred: %u, sent: %u", (unsigned) discovery_deferred_, (unsigned) discovery_sent_);
+	ESP_LOGI(TAG, "waveform frames: %u, late: %u, missed: %u",
+		(unsigned) waveform_frames_, (unsigned) waveform_late_, (unsigned) waveform_missed_);
+}
+
+void LifxDevice::dump_trace()
+{
+	if (!trace_.enabled())
+	{
+		ESP_LOGW(TAG, "Packet trace is off (trace_size: 0)");
+		return;
+	}
+	// "trace <lane> <first record number> <hex records>", eight records per line
+	const int PER_LINE = 8;
+	char hex[PER_LINE * sizeof(LifxTraceRecord) * 2 + 1];
+	for (uint8_t lane = 0; lane < TRACE_LANES; lane++)
+	{
+		LifxTraceLane l = (LifxTraceLane) lane;
+		uint32_t end = trace_.written(l);
+		ESP_LOGI(TAG, "trace %u: %u records written, %u kept", lane, (unsigned) end, (unsigned) (end - trace_.oldest(l)));
+		for (uint32_t n = trace_.oldest(l); n < end; n += PER_LINE)
+		{
+			int count = end - n < PER_LINE ? end - n : PER_LINE;
+			char *out = hex;
+			for (int i = 0; i < count; i++)
+			{
+				const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&trace_.at(l, n + i));
+				for (size_t b = 0; b < sizeof(LifxTraceRecord); b++, out += 2)
+					snprintf(out, 3, "%02x", bytes[b]);
+			}
+			*out = '\0';
+			ESP_LOGI(TAG, "trace %u %u %s", lane, (unsigned) n, hex);
+		}
+	}
+}
+
+// ---- Device messages ----
+
+// The second StateService (SERVICE_UDP5) is sent by respond_()
+uint16_t LifxDevice::encode_service_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out)
+{
+	LifxPayloadStateService *service = reinterpret_cast<LifxPayloadStateService *>(out);
+	service->service = SERVICE_UDP;
+	service->port = LifxPort;
+	return sizeof(LifxPayloadStateService);
+}
+
+uint16_t LifxDevice::encode_host_firmware_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out)
+{
+	static const byte MeshVersionData[] = {
+		0x00, 0x94, 0x18, 0x58, 0x1c, 0x05, 0xd9, 0x14,
+		0x00, 0x94, 0x18, 0x58, 0x1c, 0x05, 0xd9, 0x14,
+		0x16, 0x00, 0x01, 0x00
+	};
+	memcpy(out, MeshVersionData, sizeof(MeshVersionData));
+	if (zone_count_)
+	{
+		// Clients only use SetExtendedColorZones on LIFX Z firmware >= 2.77
+		reinterpret_cast<LifxPayloadStateFirmware *>(out)->version_minor = 80;
+		reinterpret_cast<LifxPayloadStateFirmware *>(out)->version_major = 2;
+	}
+	else if (tile_fb_)
+	{
+		reinterpret_cast<LifxPayloadStateFirmware *>(out)->version_minor = LifxTileFirmwareMinor;
+		reinterpret_cast<LifxPayloadStateFirmware *>(out)->version_major = LifxTileFirmwareMajor;
+	}
+	return sizeof(MeshVersionData);
+}
+
+uint16_t LifxDevice::encode_wifi_firmware_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out)
+{
+	static const byte WifiVersionData[] = {
+		0x00, 0x88, 0x82, 0xaa, 0x7d, 0x15, 0x35, 0x14,
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x3e, 0x00, 0x65, 0x00
+	};
+	memcpy(out, WifiVersionData, sizeof(WifiVersionData));
+	return sizeof(WifiVersionData);
+}
+
+uint16_t LifxDevice::encode_wifi_info_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out)
+{
+	LifxPayloadStateWifiInfo *info = reinterpret_cast<LifxPayloadStateWifiInfo *>(out);
+	info->signal = transport_->signal_mw();
+	if (debug_) ESP_LOGD(TAG, "RSSI: %f", info->signal);
+	// StateWifiInfo's reserved fields carry tx/rx byte counters on real bulbs
+	info->reserved6 = tx_bytes + tx_bytes_fast_;
+	info->reserved7 = rx_bytes;
+	info->reserved8 = 0;
+	return sizeof(LifxPayloadStateWifiInfo);
+}
+
+void LifxDevice::apply_power_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	// SetPower(21) and LightSetPower(117) both start with the level; only
+	// LightSetPower carries a fade duration
+	stopWaveform(false, false);
+	power_status = request.payload_as<LifxPayloadPower>()->level;
+	const LifxPayloadLightPower *light_power = request.payload_as<LifxPayloadLightPower>();
+	dur = request.type() == SET_POWER_STATE2 && light_power ? light_power->duration : 0;
+	setLight();
+}
+
+uint16_t LifxDevice::encode_power_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out)
+{
+	memcpy(out, &state.power, sizeof(state.power));
+	return sizeof(LifxPayloadPower);
+}
+
+void LifxDevice::apply_label_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	memcpy(bulbLabel, request.payload_as<LifxPayloadLabel>()->label, LifxBulbLabelLength);
+	light_version_++;
+	save_state_();
+}
+
+uint16_t LifxDevice::encode_label_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out)
+{
+	memcpy(out, &state.label, sizeof(state.label));
+	return sizeof(LifxPayloadLabel);
+}
+
+void LifxDevice::apply_tags_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	memcpy(bulbTags, request.payload(), LifxBulbTagsLength);
+	light_version_++;
+}
+
+uint16_t LifxDevice::encode_tags_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out)
+{
+	memcpy(out, bulbTags, sizeof(bulbTags));
+	return sizeof(bulbTags);
+}
+
+void LifxDevice::apply_tag_labels_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	memcpy(bulbTagLabels, request.payload(), LifxBulbTagLabelsLength);
+}
+
+uint16_t LifxDevice::encode_tag_labels_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out)
+{
+	memcpy(out, bulbTagLabels, sizeof(bulbTagLabels));
+	return sizeof(bulbTagLabels);
+}
+
+uint16_t LifxDevice::encode_version_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out)
+{
+	static const LifxPayloadStateVersion bulb = {LifxBulbVendor, LifxBulbProduct, LifxBulbVersion};
+	static const LifxPayloadStateVersion strip = {LifxBulbVendor, LifxBulbProductMultiZone, LifxBulbVersion};
+	static const LifxPayloadStateVersion tile = {LifxBulbVendor, LifxBulbProductTile, LifxBulbVersion};
+	memcpy(out, zone_count_ ? &strip : tile_fb_ ? &tile : &bulb, sizeof(LifxPayloadStateVersion));
+	return sizeof(LifxPayloadStateVersion);
+}
+
+void LifxDevice::apply_location_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	const LifxPayloadLocation *location = request.payload_as<LifxPayloadLocation>();
+	for (int i = 0; i < 16; i++)
+	{
+		bulbLocationGUIDb[guidSeq[i]] = location->location[i];
+	}
+	memcpy(bulbLocation, location->label, sizeof(bulbLocation));
+	if (location->updated_at == 0)
+	{
+		bulbLocationTime = lifx_timestamp_();
+	}
+	else
+	{
+		bulbLocationTime = location->updated_at;
+	}
+	identity_version_++;
+	save_state_();
+}
+
+uint16_t LifxDevice::encode_location_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out)
+{
+	memcpy(out, &state.location, sizeof(state.location));
+	return sizeof(LifxPayloadLocation);
+}
+
+void LifxDevice::apply_group_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	const LifxPayloadGroup *group = request.payload_as<LifxPayloadGroup>();
+	for (int i = 0; i < 16; i++)
+	{
+		bulbGroupGUIDb[guidSeq[i]] = group->group[i];
+	}
+	memcpy(bulbGroup, group->label, sizeof(bulbGroup));
+	if (group->updated_at == 0)
+	{
+		bulbGroupTime = lifx_timestamp_();
+	}
+	else
+	{
+		bulbGroupTime = group->updated_at;
+	}
+	identity_version_++;
+	save_state_();
+}
+
+uint16_t LifxDevice::encode_group_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out)
+{
+	memcpy(out, &state.group, sizeof(state.group));
+	return sizeof(LifxPayloadGroup);
+}
+
+void LifxDevice::apply_auth_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	uint32_t len = request.payload_size();
+	if (len > sizeof(authResponse))
+		len = sizeof(authResponse);
+	memcpy(authResponse, request.payload(), len);
+}
+
+uint16_t LifxDevice::encode_auth_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out)
+{
+	memcpy(out, authResponse, sizeof(authResponse));
+	return sizeof(authResponse);
+}
+
+uint16_t LifxDevice::encode_echo_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out)
+{
+	uint32_t len = request.payload_size();
+	if (len > sizeof(LifxPayloadEcho))
+		len = sizeof(LifxPayloadEcho);
+	memcpy(out, request.payload(), len);
+	return len;
+}
+
+// ---- Light messages ----
+
+// Only runs when light_version_ changed, see publish_snapshot_()
+void LifxDevice::buildLightStateData(byte *out)
+{
+	LifxPayloadLightState *state = reinterpret_cast<LifxPayloadLightState *>(out);
+	state->hue = hue;
+	state->saturation = sat;
+	state->brightness = bri;
+	state->kelvin = kel;
+	state->reserved6 = dim;
+	state->power = power_status;
+	memcpy(state->label, bulbLabel, sizeof(state->label));
+	memcpy(&state->reserved7, bulbTags, sizeof(state->reserved7));
+}
+
+uint16_t LifxDevice::encode_light_state_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out)
+{
+	memcpy(out, &state.light_state, sizeof(state.light_state));
+	return sizeof(LifxPayloadLightState);
+}
+
+void LifxDevice::apply_color_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	const LifxPayloadSetColor *color = request.payload_as<LifxPayloadSetColor>();
+	stopWaveform(false, false);
+	zones_follow_light_ = true;
+	hue = color->hue;
+	sat = color->saturation;
+	bri = color->brightness;
+	kel = color->kelvin;
+	dur = color->duration;
+
+	setLight();
+}
+
+void LifxDevice::apply_waveform_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	const LifxPayloadSetWaveform *wave = request.payload_as<LifxPayloadSetWaveform>();
+
+	if (debug_) ESP_LOGD(TAG, "Waveform: type=%u transient=%u period=%u cycles=%.1f skew=%d",
+		wave->waveform, wave->transient, wave->period, wave->cycles, wave->skew_ratio);
+
+	startWaveform(WAVEFORM_ALL_CHANNELS, *wave);
+}
+
+// SetWaveformOptional starts with SetWaveform's fields and adds the set_* flags
+static_assert(offsetof(LifxPayloadSetWaveformOptional, waveform) == offsetof(LifxPayloadSetWaveform, waveform),
+	"SetWaveformOptional must share SetWaveform's layout");
+
+void LifxDevice::apply_waveform_optional_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	const LifxPayloadSetWaveformOptional *wave = request.payload_as<LifxPayloadSetWaveformOptional>();
+
+	// Only the flagged channels change; effects running on the others carry on
+	uint8_t channels = 0;
+	if (wave->set_hue)
+		channels |= 1 << WAVEFORM_HUE;
+	if (wave->set_saturation)
+		channels |= 1 << WAVEFORM_SATURATION;
+	if (wave->set_brightness)
+		channels |= 1 << WAVEFORM_BRIGHTNESS;
+	if (wave->set_kelvin)
+		channels |= 1 << WAVEFORM_KELVIN;
+
+	if (debug_) ESP_LOGD(TAG, "WaveformOptional: type=%u transient=%u period=%u cycles=%.1f skew=%d channels=0x%x",
+		wave->waveform, wave->transient, wave->period, wave->cycles, wave->skew_ratio, channels);
+
+	startWaveform(channels, *reinterpret_cast<const LifxPayloadSetWaveform *>(wave));
+}
+
+// ---- Cloud messages ----
+
+void LifxDevice::apply_cloud_state_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	cloudStatus = request.payload()[0];
+	save_state_();
+	if (debug_) ESP_LOGD(TAG, "Cloud status changed to: %d", cloudStatus);
+}
+
+uint16_t LifxDevice::encode_cloud_state_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out)
+{
+	out[0] = cloudStatus;
+	return sizeof(cloudStatus);
+}
+
+void LifxDevice::apply_cloud_auth_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	uint32_t len = request.payload_size();
+	if (len > sizeof(cloudAuthResponse))
+		len = sizeof(cloudAuthResponse);
+	memcpy(cloudAuthResponse, request.payload(), len);
+	save_state_();
+}
+
+uint16_t LifxDevice::encode_cloud_auth_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out)
+{
+	memcpy(out, cloudAuthResponse, sizeof(cloudAuthResponse));
+	return sizeof(cloudAuthResponse);
+}
+
+void LifxDevice::apply_cloud_broker_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	uint32_t len = request.payload_size();
+	if (len > sizeof(cloudBrokerUrl))
+		len = sizeof(cloudBrokerUrl);
+	memcpy(cloudBrokerUrl, request.payload(), len);
+	save_state_();
+}
+
+uint16_t LifxDevice::encode_cloud_broker_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out)
+{
+	memcpy(out, cloudBrokerUrl, sizeof(cloudBrokerUrl));
+	return sizeof(cloudBrokerUrl);
+}
+
+// ---- MultiZone messages ----
+
+// Sends one response built in tx_buf_ for handlers that answer with several
+// messages (or none) rather than through a dispatch table encoder
+void LifxDevice::send_response_(const LifxPacketView &request, const LifxPeer &peer, uint16_t type, uint16_t protocol, uint16_t size)
+{
+	LifxPacket response;
+	init_response_(response, request, tx_buf_, tx_timestamp_);
+	response.packet_type = type;
+	response.protocol = protocol;
+	response.data_size = size;
+	tx_bytes += sendPacket(response, peer);
+}
+
+// StateZone for a single zone, otherwise StateMultiZone in blocks of 8 as
+// real strips do. A plain bulb reports itself as one zone.
+void LifxDevice::send_zone_range_(const LifxPacketView &request, const LifxPeer &peer, uint8_t start, uint8_t end)
+{
+	byte *out = tx_buf_ + LifxPacketSize;
+	if (zone_count_ == 0)
+	{
+		LifxPayloadStateZone *zone = reinterpret_cast<LifxPayloadStateZone *>(out);
+		zone->zones_count = 1;
+		zone->zone_index = 0;
+		zone->color.hue = hue;
+		zone->color.saturation = sat;
+		zone->color.brightness = bri;
+		zone->color.kelvin = kel;
+		send_response_(request, peer, STATE_COLOR_ZONE, LifxProtocol_BulbCommand, sizeof(LifxPayloadStateZone));
+		return;
+	}
+
+	if (end >= zone_count_)
+		end = zone_count_ - 1;
+	if (start > end)
+		return;
+
+	if (start == end)
+	{
+		LifxPayloadStateZone *zone = reinterpret_cast<LifxPayloadStateZone *>(out);
+		zone->zones_count = zone_count_;
+		zone->zone_index = start;
+		zone->color = zones_[start];
+		send_response_(request, peer, STATE_COLOR_ZONE, LifxProtocol_BulbCommand, sizeof(LifxPayloadStateZone));
+		return;
+	}
+
+	for (unsigned index = start; index <= end; index += 8)
+	{
+		LifxPayloadStateMultiZone *multi = reinterpret_cast<LifxPayloadStateMultiZone *>(out);
+		memset(multi, 0, sizeof(LifxPayloadStateMultiZone));
+		multi->zones_count = zone_count_;
+		multi->zone_index = index;
+		for (unsigned i = 0; i < 8 && index + i < zone_count_; i++)
+			multi->colors[i] = zones_[index + i];
+		send_response_(request, peer, STATE_MULTI_ZONE, LifxProtocol_BulbCommand, sizeof(LifxPayloadStateMultiZone));
+	}
+}
+
+// StateExtendedColorZones, 82 zones per message
+void LifxDevice::send_ext_zones_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	LifxPayloadStateExtColorZones *state = reinterpret_cast<LifxPayloadStateExtColorZones *>(tx_buf_ + LifxPacketSize);
+	const uint16_t per_message = sizeof(state->colors) / sizeof(state->colors[0]);
+	uint16_t count = zone_count_ ? zone_count_ : 1;
+	for (uint16_t index = 0; index < count; index += per_message)
+	{
+		memset(state, 0, sizeof(LifxPayloadStateExtColorZones));
+		state->zones_count = count;
+		state->zone_index = index;
+		uint16_t remaining = count - index;
+		state->colors_count = remaining < per_message ? remaining : per_message;
+		if (zone_count_)
+		{
+			memcpy(state->colors, zones_ + index, state->colors_count * sizeof(LifxHSBK));
+		}
+		else
+		{
+			state->colors[0].hue = hue;
+			state->colors[0].saturation = sat;
+			state->colors[0].brightness = bri;
+			state->colors[0].kelvin = kel;
+		}
+		send_response_(request, peer, STATE_EXT_COLOR_ZONES, LifxProtocol_BulbCommand, sizeof(LifxPayloadStateExtColorZones));
+	}
+}
+
+// NO_APPLY only stages the colors; APPLY and APPLY_ONLY show the staged buffer
+void LifxDevice::commit_zones_(uint8_t apply, uint32_t duration)
+{
+	if (apply == APPLY_NO_APPLY)
+		return;
+	memcpy(zones_applied_, zones_, zone_count_ * sizeof(LifxHSBK));
+	rotate_applied_zones_(zone_effect_offset_);
+	dur = duration;
+	setLight();
+}
+
+void LifxDevice::apply_color_zones_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	if (zone_count_ == 0)
+	{
+		if (debug_) ESP_LOGD(TAG, "SetColorZones ignored, no zones configured");
+		return;
+	}
+	const LifxPayloadSetColorZones *set = request.payload_as<LifxPayloadSetColorZones>();
+	uint8_t end = set->end_index < zone_count_ ? set->end_index : zone_count_ - 1;
+
+	stopWaveform(false, set->apply == APPLY_NO_APPLY);
+	zones_follow_light_ = false;
+	if (set->apply != APPLY_APPLY_ONLY)
+	{
+		for (unsigned i = set->start_index; i <= end; i++)
+			zones_[i] = set->color;
+	}
+	commit_zones_(set->apply, set->duration);
+
+	if (request.res_ack() & RES_REQUIRED)
+		send_zone_range_(request, peer, set->start_index, end);
+}
+
+void LifxDevice::send_color_zones_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	// GetColorZones carries start_index, end_index
+	uint8_t start = 0, end = 255;
+	if (request.payload_size() >= 2)
+	{
+		start = request.payload()[0];
+		end = request.payload()[1];
+	}
+	send_zone_range_(request, peer, start, end);
+}
+
+void LifxDevice::apply_ext_color_zones_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	if (zone_count_ == 0)
+	{
+		if (debug_) ESP_LOGD(TAG, "SetExtendedColorZones ignored, no zones configured");
+		return;
+	}
+	// Only the colors actually present in the datagram are read
+	const LifxPayloadSetExtColorZones *set = reinterpret_cast<const LifxPayloadSetExtColorZones *>(request.payload());
+	size_t present = (request.payload_size() - offsetof(LifxPayloadSetExtColorZones, colors)) / sizeof(LifxHSBK);
+	size_t count = set->colors_count < present ? set->colors_count : present;
+
+	stopWaveform(false, set->apply == APPLY_NO_APPLY);
+	zones_follow_light_ = false;
+	if (set->apply != APPLY_APPLY_ONLY)
+	{
+		for (size_t i = 0; i < count && set->zone_index + i < zone_count_; i++)
+			zones_[set->zone_index + i] = set->colors[i];
+	}
+	commit_zones_(set->apply, set->duration);
+
+	if (request.res_ack() & RES_REQUIRED)
+		send_ext_zones_(request, peer);
+}
+
+void LifxDevice::send_ext_color_zones_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	send_ext_zones_(request, peer);
+}
+
+// Moves the shown zones shift places in the MOVE direction
+void LifxDevice::rotate_applied_zones_(uint16_t shift)
+{
+	shift %= zone_count_ ? zone_count_ : 1;
+	if (shift == 0)
+		return;
+	uint32_t direction;
+	memcpy(&direction, zone_effect_.parameters + 4, sizeof(direction));
+	LifxHSBK *end = zones_applied_ + zone_count_;
+	if (direction == MULTIZONE_MOVE_TOWARDS_START)
+		std::rotate(zones_applied_, zones_applied_ + shift, end);
+	else
+		std::rotate(zones_applied_, end - shift, end);
+}
+
+// MOVE runs on the device so clients don't have to stream zone frames: the
+// pattern travels the whole strip once per `speed` ms, one zone at a time,
+// phase locked to the effect start and no faster than waveform_fps allows
+void LifxDevice::render_zone_effect_()
+{
+	uint32_t elapsed = clock_->millis() - zone_effect_start_;
+	if (elapsed < zone_effect_next_)
+		return;
+
+	// SetColor or a waveform painted the strip in one color, nothing left to move
+	uint64_t duration_ms = zone_effect_.duration / 1000000;
+	if (zones_follow_light_ || (duration_ms && elapsed >= duration_ms))
+	{
+		stop_zone_effect_();
+		return;
+	}
+
+	uint32_t speed = zone_effect_.speed ? zone_effect_.speed : 1;
+	uint64_t steps = (uint64_t) elapsed * zone_count_ / speed;
+	uint16_t offset = steps % zone_count_;
+	if (offset != zone_effect_offset_)
+	{
+		rotate_applied_zones_(offset + zone_count_ - zone_effect_offset_);
+		zone_effect_offset_ = offset;
+		dur = 0;
+		setLight();
+	}
+
+	// Exactly when the next zone step is due, or the fps limit if that is later
+	uint64_t next = ((steps + 1) * speed + zone_count_ - 1) / zone_count_;
+	uint32_t fastest = elapsed + 1000 / waveform_fps_;
+	zone_effect_next_ = next > fastest ? (next > UINT32_MAX ? UINT32_MAX : (uint32_t) next) : fastest;
+	if (duration_ms && zone_effect_next_ > duration_ms)
+		zone_effect_next_ = (uint32_t) duration_ms;
+}
+
+// The strip stays where it stopped; the next APPLY shows zones unshifted
+void LifxDevice::stop_zone_effect_()
+{
+	if (debug_ && zone_effect_.type != MULTIZONE_EFFECT_OFF) ESP_LOGD(TAG, "MultiZone effect stopped");
+	zone_effect_.type = MULTIZONE_EFFECT_OFF;
+	zone_effect_offset_ = 0;
+}
+
+void LifxDevice::apply_zone_effect_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	if (zone_count_ == 0)
+	{
+		if (debug_) ESP_LOGD(TAG, "SetMultiZoneEffect ignored, no zones configured");
+		return;
+	}
+	const LifxPayloadMultiZoneEffect *effect = request.payload_as<LifxPayloadMultiZoneEffect>();
+	stop_zone_effect_();
+	zone_effect_ = *effect;
+	if (effect->type != MULTIZONE_EFFECT_MOVE)
+	{
+		zone_effect_.type = MULTIZONE_EFFECT_OFF;
+		return;
+	}
+
+	zone_effect_start_ = clock_->millis();
+	zone_effect_next_ = 0;
+	if (debug_) ESP_LOGD(TAG, "MultiZone MOVE: speed=%u ms, duration=%u ms",
+		(unsigned) effect->speed, (unsigned) (effect->duration / 1000000));
+}
+
+uint16_t LifxDevice::encode_zone_effect_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out)
+{
+	memcpy(out, &zone_effect_, sizeof(zone_effect_));
+	return sizeof(LifxPayloadMultiZoneEffect);
+}
+
+// ---- Tile messages ----
+//
+// The emulated device is a chain of one tile. Handlers ignore tile_index > 0
+// and stay silent when no tile is configured, as a non-tile bulb would.
+
+// Shows framebuffer 0 at the next loop(), replacing any SetColor fill or effect
+void LifxDevice::present_tile_(uint32_t duration)
+{
+	stopWaveform(false, false);
+	stop_tile_effect_();
+	zones_follow_light_ = false;
+	dur = duration;
+	setLight();
+}
+
+void LifxDevice::send_device_chain_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	if (!tile_fb_)
+		return;
+	LifxPayloadStateDeviceChain *chain = reinterpret_cast<LifxPayloadStateDeviceChain *>(tx_buf_ + LifxPacketSize);
+	memset(chain, 0, sizeof(LifxPayloadStateDeviceChain));
+	LifxTileDevice &tile = chain->tile_devices[0];
+	tile.user_x = tile_user_x_;
+	tile.user_y = tile_user_y_;
+	tile.width = tile_width_;
+	tile.height = tile_height_;
+	tile.device_version_vendor = LifxBulbVendor;
+	tile.device_version_product = LifxBulbProductTile;
+	tile.firmware_version_minor = LifxTileFirmwareMinor;
+	tile.firmware_version_major = LifxTileFirmwareMajor;
+	chain->tile_devices_count = 1;
+	send_response_(request, peer, STATE_DEVICE_CHAIN, LifxProtocol_BulbCommand, sizeof(LifxPayloadStateDeviceChain));
+}
+
+void LifxDevice::apply_user_position_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	const LifxPayloadSetUserPosition *position = request.payload_as<LifxPayloadSetUserPosition>();
+	if (!tile_fb_ || position->tile_index != 0)
+		return;
+	tile_user_x_ = position->user_x;
+	tile_user_y_ = position->user_y;
+}
+
+// State64 with up to 64 pixels of framebuffer 0 starting at (x, y), `width`
+// pixels per row; pixels outside the tile read as zero
+void LifxDevice::send_tile_state64_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	const LifxPayloadGet64 *get = request.payload_as<LifxPayloadGet64>();
+	if (!tile_fb_ || !get || get->tile_index != 0 || get->length == 0)
+		return;
+	uint8_t width = get->width ? get->width : tile_width_;
+
+	LifxPayloadState64 *state = reinterpret_cast<LifxPayloadState64 *>(tx_buf_ + LifxPacketSize);
+	memset(state, 0, sizeof(LifxPayloadState64));
+	state->x = get->x;
+	state->y = get->y;
+	state->width = width;
+	const LifxHSBK *shown = tile_framebuffer_(0);
+	for (unsigned i = 0; i < 64; i++)
+	{
+		unsigned x = get->x + i % width;
+		unsigned y = get->y + i / width;
+		if (x < tile_width_ && y < tile_height_)
+			state->colors[i] = shown[y * tile_width_ + x];
+	}
+	send_response_(request, peer, STATE_TILE_STATE64, LifxProtocol_BulbCommand, sizeof(LifxPayloadState64));
+}
+
+void LifxDevice::apply_tile_state64_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	const LifxPayloadSet64 *set = reinterpret_cast<const LifxPayloadSet64 *>(request.payload());
+	if (!tile_fb_ || set->tile_index != 0 || set->length == 0)
+		return;
+	if (set->fb_index >= tile_fb_count_)
+	{
+		if (debug_) ESP_LOGD(TAG, "Set64 to framebuffer %u ignored, %u configured", set->fb_index, tile_fb_count_);
+		return;
+	}
+	// Only the colors actually present in the datagram are read
+	size_t present = (request.payload_size() - offsetof(LifxPayloadSet64, colors)) / sizeof(LifxHSBK);
+	size_t count = present < 64 ? present : 64;
+	uint8_t width = set->width ? set->width : tile_width_;
+
+	LifxHSBK *fb = tile_framebuffer_(set->fb_index);
+	for (size_t i = 0; i < count; i++)
+	{
+		unsigned x = set->x + i % width;
+		unsigned y = set->y + i / width;
+		if (x < tile_width_ && y < tile_height_)
+			fb[y * tile_width_ + x] = set->colors[i];
+	}
+	if (set->fb_index == 0)
+		present_tile_(set->duration);
+}
+
+// Copies a rectangle between framebuffers, clipped to the tile. Copying into
+// framebuffer 0 presents a frame that was drawn off screen in one step.
+void LifxDevice::apply_copy_frame_buffer_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	const LifxPayloadCopyFrameBuffer *copy = request.payload_as<LifxPayloadCopyFrameBuffer>();
+	if (!tile_fb_ || copy->tile_index != 0 || copy->length == 0)
+		return;
+	if (copy->src_fb_index >= tile_fb_count_ || copy->dst_fb_index >= tile_fb_count_)
+	{
+		if (debug_) ESP_LOGD(TAG, "CopyFrameBuffer %u -> %u ignored, %u framebuffers configured",
+			copy->src_fb_index, copy->dst_fb_index, tile_fb_count_);
+		return;
+	}
+
+	unsigned width = copy->width, height = copy->height;
+	unsigned src_x = copy->src_x, src_y = copy->src_y, dst_x = copy->dst_x, dst_y = copy->dst_y;
+	if (src_x >= tile_width_ || dst_x >= tile_width_ || src_y >= tile_height_ || dst_y >= tile_height_)
+		width = height = 0;
+	if (width > tile_width_ - src_x) width = tile_width_ - src_x;
+	if (width > tile_width_ - dst_x) width = tile_width_ - dst_x;
+	if (height > tile_height_ - src_y) height = tile_height_ - src_y;
+	if (height > tile_height_ - dst_y) height = tile_height_ - dst_y;
+
+	const LifxHSBK *src = tile_framebuffer_(copy->src_fb_index);
+	LifxHSBK *dst = tile_framebuffer_(copy->dst_fb_index);
+	// Within one framebuffer, walk rows so overlapping source rows are read before they are overwritten
+	bool bottom_up = src == dst && dst_y > src_y;
+	for (unsigned row = 0; row < height; row++)
+	{
+		unsigned r = bottom_up ? height - 1 - row : row;
+		memmove(dst + (dst_y + r) * tile_width_ + dst_x, src + (src_y + r) * tile_width_ + src_x, width * sizeof(LifxHSBK));
+	}
+
+	if (copy->dst_fb_index == 0)
+		present_tile_(copy->duration);
+}
+
+void LifxDevice::send_tile_effect_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	if (!tile_fb_)
+		return;
+	LifxPayloadStateTileEffect *state = reinterpret_cast<LifxPayloadStateTileEffect *>(tx_buf_ + LifxPacketSize);
+	state->reserved0 = 0;
+	state->settings = tile_effect_;
+	send_response_(request, peer, STATE_TILE_EFFECT, LifxProtocol_BulbCommand, sizeof(LifxPayloadStateTileEffect));
+}
+
+// Emulator extension: every kept trace record, one StateTrace per chunk
+void LifxDevice::send_trace_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	if (!trace_.enabled())
+		return;
+	LifxPayloadStateTrace *state = reinterpret_cast<LifxPayloadStateTrace *>(tx_buf_ + LifxPacketSize);
+	for (uint8_t lane = 0; lane < TRACE_LANES; lane++)
+	{
+		LifxTraceLane l = (LifxTraceLane) lane;
+		uint32_t end = trace_.written(l);
+		for (uint32_t n = trace_.oldest(l); n < end; n += LIFX_TRACE_RECORDS_PER_PACKET)
+		{
+			uint8_t count = end - n < LIFX_TRACE_RECORDS_PER_PACKET ? end - n : LIFX_TRACE_RECORDS_PER_PACKET;
+			state->lane = lane;
+			state->count = count;
+			state->capacity = trace_.capacity();
+			state->first = n;
+			state->written = end;
+			for (uint8_t i = 0; i < count; i++)
+				state->records[i] = trace_.at(l, n + i);
+			send_response_(request, peer, STATE_TRACE, LifxProtocol_BulbCommand,
+				offsetof(LifxPayloadStateTrace, records) + count * sizeof(LifxTraceRecord));
+		}
+	}
+}
+
+void LifxDevice::apply_tile_effect_(const LifxPacketView &request, const LifxPeer &peer)
+{
+	if (!tile_fb_)
+		return;
+	const LifxPayloadSetTileEffect *set = reinterpret_cast<const LifxPayloadSetTileEffect *>(request.payload());
+	// Only the palette entries actually present in the datagram are read
+	size_t palette_at = offsetof(LifxPayloadSetTileEffect, settings) + offsetof(LifxTileEffectSettings, palette);
+	size_t present = (request.payload_size() - palette_at) / sizeof(LifxHSBK);
+	uint8_t count = set->settings.palette_count < present ? set->settings.palette_count : present;
+	if (count > 16)
+		count = 16;
+
+	stop_tile_effect_();
+	memcpy(&tile_effect_, &set->settings, offsetof(LifxTileEffectSettings, palette));
+	memset(tile_effect_.palette, 0, sizeof(tile_effect_.palette));
+	memcpy(tile_effect_.palette, set->settings.palette, count * sizeof(LifxHSBK));
+	tile_effect_.palette_count = count;
+	if (tile_effect_.type != TILE_EFFECT_MORPH && tile_effect_.type != TILE_EFFECT_FLAME && tile_effect_.type != TILE_EFFECT_SKY)
+		tile_effect_.type = TILE_EFFECT_OFF;
+
+	if (tile_effect_.type != TILE_EFFECT_OFF)
+	{
+		stopWaveform(false);
+		zones_follow_light_ = false;
+		tile_effect_start_ = clock_->millis();
+		tile_effect_next_ = 0;
+		if (debug_) ESP_LOGD(TAG, "Tile effect %u: speed=%u ms, duration=%u ms, palette=%u",
+			tile_effect_.type, (unsigned) tile_effect_.speed, (unsigned) (tile_effect_.duration / 1000000), count);
+	}
+
+	if (request.res_ack() & RES_REQUIRED)
+		send_tile_effect_(request, peer);
+}
+
+// Draws one effect frame into framebuffer 0, no faster than waveform_fps.
+// SUNRISE/SUNSET run once over `duration` (or `speed` without one) and stay
+// on their last frame; the others loop until replaced or `duration` is up.
+void LifxDevice::render_tile_effect_()
+{
+	uint32_t elapsed = clock_->millis() - tile_effect_start_;
+	if (elapsed < tile_effect_next_)
+		return;
+	// SetColor or a waveform painted the tile in one color
+	if (zones_follow_light_)
+	{
+		stop_tile_effect_();
+		return;
+	}
+
+	uint32_t speed = tile_effect_.speed ? tile_effect_.speed : 1;
+	uint64_t length = tile_effect_.duration / 1000000;
+	bool sun = tile_effect_.type == TILE_EFFECT_SKY && tile_effect_.sky_type != TILE_SKY_CLOUDS;
+	if (sun && length == 0)
+		length = speed;
+	bool finished = length && elapsed >= length;
+	if (finished)
+		elapsed = (uint32_t) length;
+
+	uint32_t time = (uint32_t)(((uint64_t) elapsed << 16) / speed);
+	LifxHSBK *shown = tile_framebuffer_(0);
+	switch (tile_effect_.type)
+	{
+	case TILE_EFFECT_MORPH:
+		lifx_tile_morph(shown, tile_width_, tile_height_, time, tile_effect_.palette, tile_effect_.palette_count);
+		break;
+	case TILE_EFFECT_FLAME:
+		lifx_tile_flame(shown, tile_width_, tile_height_, time, bri);
+		break;
+	default:
+		if (sun)
+		{
+			uint16_t progress = length ? (uint16_t)((uint64_t) elapsed * 65535 / length) : 65535;
+			uint16_t level = tile_effect_.sky_type == TILE_SKY_SUNRISE ? progress : 65535 - progress;
+			lifx_tile_sun(shown, tile_width_, tile_height_, level, bri);
+		}
+		else
+		{
+			lifx_tile_clouds(shown, tile_width_, tile_height_, time, bri,
+				tile_effect_.cloud_saturation_min, tile_effect_.cloud_saturation_max);
+		}
+		break;
+	}
+	dur = 0;
+	setLight();
+
+	if (finished)
+	{
+		stop_tile_effect_();
+		return;
+	}
+	tile_effect_next_ = elapsed + 1000 / waveform_fps_;
+	if (length && tile_effect_next_ > length)
+		tile_effect_next_ = (uint32_t) length;
+}
+
+// The tile keeps showing the last effect frame
+void LifxDevice::stop_tile_effect_()
+{
+	if (debug_ && tile_effect_.type != TILE_EFFECT_OFF) ESP_LOGD(TAG, "Tile effect stopped");
+	tile_effect_.type = TILE_EFFECT_OFF;
+}
+
+// The set's queue; null outside a set or with queueing off (frames run inline)
+LifxFrameQueue *LifxDevice::rx_queue_() const
+{
+	return set_ ? set_->rx_queue() : nullptr;
+}
+
+unsigned int LifxDevice::sendPacket(LifxPacket &pkt, const LifxPeer &peer)
+{
+	// Handlers write the payload straight after the header via pkt.data
+	uint8_t *frame = pkt.data - LifxPacketSize;
+	unsigned int totalSize = LifxPacketSize + pkt.data_size;
+
+	// The buffer is shared by every device, so our addresses go in each time;
+	// the reserved fields are never written and stay zero
+	LifxWireHeader *header = reinterpret_cast<LifxWireHeader *>(frame);
+	memcpy(header->target, mac, sizeof(mac));
+	// site mac address (LIFXV2) follows two bytes of MAC padding
+	memcpy(header->reserved2 + 2, site_mac, sizeof(site_mac));
+	header->size = totalSize;
+	header->protocol = pkt.protocol;
+	memcpy(header->source, pkt.source, sizeof(header->source));
+	header->res_ack = pkt.res_ack;
+	header->sequence = pkt.sequence;
+	header->timestamp = pkt.timestamp;
+	header->type = pkt.packet_type;
+
+	uint32_t start = clock_->micros();
+	transport_->send(peer, frame, totalSize);
+	uint32_t elapsed = clock_->micros() - start;
+	latency_[LATENCY_SEND].record(elapsed);
+	// Callback replies go out of fast_tx_buf_; StateTrace chunks would trace the dump itself
+	if (trace_.enabled() && pkt.packet_type != STATE_TRACE)
+		trace_.record(frame == fast_tx_buf_ || !rx_queue_() ? TRACE_LANE_NETWORK : TRACE_LANE_LOOP,
+			TRACE_SENT, start, elapsed, frame, totalSize);
+
+	if (log_packets_()) ESP_LOGD(TAG, "<- %s (0x%02X/%d, %u bytes)", lifx_packet_type_name(pkt.packet_type), pkt.packet_type, pkt.packet_type, totalSize);
+	return totalSize;
+}
+
+uint16_t &LifxDevice::channel_value_(uint8_t channel)
+{
+	switch (channel)
+	{
+	case WAVEFORM_HUE:        return hue;
+	case WAVEFORM_SATURATION: return sat;
+	case WAVEFORM_BRIGHTNESS: return bri;
+	default:                  return kel;
+	}
+}
+
+void LifxDevice::startWaveform(uint8_t channels, const LifxPayloadSetWaveform &wave)
+{
+	if (channels == 0)
+		return;
+	zones_follow_light_ = true;
+
+	uint32_t now = clock_->millis();
+	const uint16_t target[WAVEFORM_CHANNELS] = {wave.hue, wave.saturation, wave.brightness, wave.kelvin};
+
+	// Enough frames per cycle for short periods, fewer for slow multi-second waves
+	uint32_t fastest = 1000 / waveform_fps_;
+	uint32_t interval = wave.period / LIFX_WAVEFORM_SAMPLES_PER_CYCLE;
+	if (interval > LIFX_WAVEFORM_MAX_INTERVAL_MS)
+		interval = LIFX_WAVEFORM_MAX_INTERVAL_MS;
+	if (interval < fastest)
+		interval = fastest;
+
+	for (uint8_t i = 0; i < WAVEFORM_CHANNELS; i++)
+	{
+		if (!(channels & (1 << i)))
+			continue;
+		LifxWaveformChannel &channel = waveform_channels_[i];
+		uint16_t &value = channel_value_(i);
+
+		// A replaced effect hands over the value it would have settled on
+		if (channel.active)
+			value = channel.resting();
+		channel.active = false;
+
+		if (wave.period == 0)
+		{
+			// Instant: just apply the target directly
+			value = target[i];
+			continue;
+		}
+
+		channel.active = true;
+		channel.transient = wave.transient != 0;
+		channel.waveform = wave.waveform;
+		channel.from = value;
+		channel.to = target[i];
+		channel.start = now;
+		channel.period = wave.period;
+		// Everything renderWaveform() needs per frame, in integers
+		channel.total_ms = wave.cycles > 0 ? (uint32_t)(wave.period * wave.cycles) : 0;
+		// skew_ratio -32768..32767 maps to 0..1, duty = 1 - ratio
+		channel.duty_ms = (uint32_t)(((uint64_t) wave.period * (32767 - wave.skew_ratio)) / 65535);
+		channel.phase_step = 0xFFFFFFFFu / wave.period;
+		channel.interval = interval;
+		channel.next = 0;
+	}
+
+	waveform_active_ = false;
+	for (const LifxWaveformChannel &channel : waveform_channels_)
+		waveform_active_ |= channel.active;
+	if (wave.period == 0)
+	{
+		dur = 0;
+		setLight();
+	}
+
+	if (debug_) ESP_LOGD(TAG, "Waveform started on channels 0x%x: current(%u,%u,%u,%u) -> target(%u,%u,%u,%u)",
+		channels, hue, sat, bri, kel, wave.hue, wave.saturation, wave.brightness, wave.kelvin);
+}
+
+void LifxDevice::stopWaveform(bool restore, bool apply)
+{
+	if (!waveform_active_) return;
+	waveform_active_ = false;
+
+	// restore: return to the original color; otherwise end on the target
+	for (uint8_t i = 0; i < WAVEFORM_CHANNELS; i++)
+	{
+		LifxWaveformChannel &channel = waveform_channels_[i];
+		if (!channel.active)
+			continue;
+		channel.active = false;
+		channel_value_(i) = restore ? channel.from : channel.to;
+	}
+
+	if (apply)
+	{
+		dur = 0;
+		setLight();
+	}
+
+	if (debug_) ESP_LOGD(TAG, "Waveform stopped (restore=%s)", restore ? "true" : "false");
+}
+
+void LifxDevice::loop()
+{
+	// Responses within one loop tick share a timestamp (it has 1s resolution anyway)
+	tx_timestamp_ = lifx_timestamp_();
+
+	// Everything that mutates state runs here, on the main task
+	if (set_)
+		set_->drain();
+	if (discovery_pending_)
+		send_due_discovery_();
+
+	if (waveform_active_)
+		renderWaveform();
+	if (zone_effect_.type == MULTIZONE_EFFECT_MOVE)
+		render_zone_effect_();
+	if (tile_effect_.type != TILE_EFFECT_OFF)
+		render_tile_effect_();
+	publish_snapshot_();
+
+	// Apply only the latest requested state, however many packets changed it
+	if (light_dirty_)
+		flushLight();
+	if (transition_active_)
+		render_transition_();
+
+	if (save_pending_ && clock_->millis() - save_requested_at_ >= save_delay_ms_)
+		flush_state();
+}
+
+void LifxDevice::renderWaveform()
+{
+	// Late/missed are counted once per frame, for the worst channel
+	uint32_t now = clock_->millis();
+	bool due = false, late = false;
+	uint32_t missed = 0;
+	for (LifxWaveformChannel &channel : waveform_channels_)
+	{
+		if (!channel.active || now - channel.start < channel.next)
+			continue;
+		uint32_t lateness = now - channel.start - channel.next;
+		late |= lateness > channel.interval / 2;
+		if (missed < lateness / channel.interval)
+			missed = lateness / channel.interval;
+		due = true;
+	}
+	if (!due)
+		return;
+	waveform_frames_++;
+	waveform_late_ += late;
+	waveform_missed_ += missed;
+
+	// Every running channel is sampled, whichever of them was due
+	bool still_active = false;
+	for (uint8_t i = 0; i < WAVEFORM_CHANNELS; i++)
+	{
+		LifxWaveformChannel &channel = waveform_channels_[i];
+		if (!channel.active)
+			continue;
+		uint32_t elapsed = now - channel.start;
+		// Finite effects end on their own (transient ones back on the original)
+		if (channel.total_ms && elapsed >= channel.total_ms)
+		{
+			channel.active = false;
+			channel_value_(i) = channel.resting();
+			continue;
+		}
+		channel_value_(i) = channel.sample(elapsed, i == WAVEFORM_HUE);
+		if (elapsed >= channel.next)
+			channel.next = next_waveform_frame_(channel, elapsed);
+		still_active = true;
+	}
+	waveform_active_ = still_active;
+
+	dur = 0; // No transition for waveform frame updates
+	setLight();
+}
+
+// Next grid slot after elapsed. PULSE only changes on its edges, so it is
+// rendered exactly there instead (no sooner than the fps limit allows).
+// Finite waveforms also get a frame at their end so they stop on time.
+uint32_t LifxDevice::next_waveform_frame_(const LifxWaveformChannel &channel, uint32_t elapsed) const
+{
+	uint32_t next;
+	if (channel.waveform == WAVEFORM_PULSE)
+	{
+		uint32_t cycle_start = elapsed - elapsed % channel.period;
+		next = cycle_start + channel.duty_ms > elapsed ? cycle_start + channel.duty_ms : cycle_start + channel.period;
+		uint32_t fastest = elapsed + 1000 / waveform_fps_;
+		if (next < fastest)
+			next = fastest;
+	}
+	else
+	{
+		next = (elapsed / channel.interval + 1) * channel.interval;
+	}
+	if (channel.total_ms && next > channel.total_ms)
+		next = channel.total_ms;
+	return next;
+}
+
+// Handlers only mark the light dirty; loop() pushes the latest state to the
+// output once per iteration so bursts of SetColor/SetPower collapse into one
+// LightCall.
+void LifxDevice::setLight()
+{
+	if (light_dirty_)
+		light_coalesced_++;
+	light_dirty_ = true;
+	light_version_++;
+}
+
+void LifxDevice::flushLight()
+{
+	light_dirty_ = false;
+	light_applied_++;
+
+	if (debug_) ESP_LOGD(TAG, "Set light - hue: %u, sat: %u, bri: %u, kel: %u, dur: %u, power: %s",
+		hue, sat, bri, kel, (unsigned) dur, power_status ? "on" : "off");
+
+	if (zone_count_)
+	{
+		if (zones_follow_light_)
+		{
+			LifxHSBK color = {hue, sat, bri, kel};
+			for (unsigned i = 0; i < zone_count_; i++)
+				zones_[i] = zones_applied_[i] = color;
+		}
+		LifxLatencyScope timing(latency_[LATENCY_LIGHT], clock_);
+		zone_output_->apply_zones(zones_applied_, zone_count_, power_status, dur);
+		return;
+	}
+	if (tile_fb_)
+	{
+		LifxHSBK *shown = tile_framebuffer_(0);
+		if (zones_follow_light_)
+		{
+			LifxHSBK color = {hue, sat, bri, kel};
+			for (unsigned i = 0; i < get_tile_pixels(); i++)
+				shown[i] = color;
+		}
+		LifxLatencyScope timing(latency_[LATENCY_LIGHT], clock_);
+		zone_output_->apply_zones(shown, get_tile_pixels(), power_status, dur);
+		return;
+	}
+
+	// A new target mid-fade starts from where the fade is now, not from its
+	// last frame; a zero duration (waveform frames included) cuts it short
+	if (transition_active_)
+	{
+		uint32_t elapsed = clock_->millis() - transition_start_;
+		if (elapsed < transition_ms_)
+			shown_ = transition_at_(elapsed);
+		transition_active_ = false;
+	}
+	if (transition_fps_ && dur)
+	{
+		start_transition_();
+		return;
+	}
+	LifxHSBK color = {hue, sat, bri, kel};
+	apply_light_(color, power_status, dur);
+}
+
+void LifxDevice::apply_light_(const LifxHSBK &color, uint16_t power, uint32_t duration)
+{
+	shown_ = color;
+	if (!power)
+		shown_.brightness = 0;
+
+	LifxLightCommand cmd;
+	cmd.hue = color.hue;
+	cmd.sat = color.saturation;
+	cmd.bri = color.brightness;
+	cmd.kel = color.kelvin;
+	cmd.power = power;
+	cmd.duration = duration;
+	LifxLatencyScope timing(latency_[LATENCY_LIGHT], clock_);
+	light_->apply(cmd);
+}
+
+// Fades from what is shown now to the requested state over dur ms. Power
+// is folded into brightness: the light stays on at 0 brightness while it
+// fades up or down, and only takes the requested power at the end.
+void LifxDevice::start_transition_()
+{
+	transition_from_ = shown_;
+	transition_to_ = {hue, sat, power_status ? bri : (uint16_t) 0, kel};
+	// Coming up from black there is no color to fade from; going down to it
+	// there is no color to fade to
+	if (transition_from_.brightness == 0)
+	{
+		transition_from_.hue = transition_to_.hue;
+		transition_from_.saturation = transition_to_.saturation;
+		transition_from_.kelvin = transition_to_.kelvin;
+	}
+	else if (!power_status)
+	{
+		transition_to_.hue = transition_from_.hue;
+		transition_to_.saturation = transition_from_.saturation;
+		transition_to_.kelvin = transition_from_.kelvin;
+	}
+	transition_power_ = power_status;
+	transition_start_ = clock_->millis();
+	transition_ms_ = dur;
+	// The first frame would only repeat what is shown
+	uint32_t interval = 1000 / transition_fps_;
+	transition_next_ = interval < dur ? interval : dur;
+	transition_active_ = true;
+}
+
+// Fade color elapsed ms in (less than transition_ms_), hue the short way round
+LifxHSBK LifxDevice::transition_at_(uint32_t elapsed) const
+{
+	uint32_t t = (uint32_t)(((uint64_t) elapsed << 16) / transition_ms_);
+	return {
+		lifx_lerp_hue16(transition_from_.hue, transition_to_.hue, t),
+		lifx_lerp16(transition_from_.saturation, transition_to_.saturation, t),
+		lifx_lerp16(transition_from_.brightness, transition_to_.brightness, t),
+		lifx_lerp16(transition_from_.kelvin, transition_to_.kelvin, t),
+	};
+}
+
+void LifxDevice::render_transition_()
+{
+	uint32_t elapsed = clock_->millis() - transition_start_;
+	if (elapsed < transition_next_)
+		return;
+	transition_frames_++;
+
+	if (elapsed >= transition_ms_)
+	{
+		transition_active_ = false;
+		LifxHSBK color = {hue, sat, bri, kel};
+		apply_light_(color, transition_power_, 0);
+		return;
+	}
+
+	apply_light_(transition_at_(elapsed), 65535, 0);
+
+	// Phase locked to the start, and always a frame on the end
+	uint32_t interval = 1000 / transition_fps_;
+	transition_next_ = (elapsed / interval + 1) * interval;
+	if (transition_next_ > transition_ms_)
+		transition_next_ = transition_ms_;
+}
+
+} // namespace lifx_emulation
+} // namespace esphome
@@ -0,0 +1,550 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+
+#include "lifx_platform.h"
+#include "lifx_protocol.h"
+#include "lifx_queue.h"
+#include "lifx_stats.h"
+#include "lifx_trace.h"
+#include "lifx_waveform.h"
+
+namespace esphome {
+namespace lifx_emulation {
+
+struct LifxPersistentState {
+	uint32_t yaml_hash;
+	char bulbLabel[32];
+	char bulbLocation[32];
+	char bulbLocationGUID[37];
+	uint64_t bulbLocationTime;
+	char bulbGroup[32];
+	char bulbGroupGUID[37];
+	uint64_t bulbGroupTime;
+	// Cloud state (always restored, independent of yaml_hash)
+	uint8_t cloudStatus;
+	uint8_t cloudBrokerUrl[33];
+	uint8_t cloudAuthResponse[32];
+	uint8_t authResponse[56];
+};
+
+// Pre-encoded payloads of the state GET responses. loop() publishes a copy
+// under a seqlock so the UDP callback can answer GETs without touching the
+// live fields the main loop is mutating. Payloads are only re-encoded when
+// the version they were built from is stale.
+struct LifxStateSnapshot {
+	uint64_t timestamp; // header timestamp for responses
+	uint32_t light_version;
+	uint32_t identity_version;
+	LifxPayloadLightState light_state;
+	LifxPayloadPower power;
+	LifxPayloadLabel label;
+	LifxPayloadLocation location;
+	LifxPayloadGroup group;
+};
+
+// Recent SETs of one client (source). Retransmissions after a lost ack
+// repeat the frame with the same source + sequence; sequences wrap at 256.
+#define LIFX_SEQUENCE_SOURCES 8
+#define LIFX_SEQUENCE_RECENT 8
+// A client quiet this long may have restarted with the same source
+#define LIFX_SEQUENCE_EXPIRE_MS 2000
+// Clients share one 8-bit counter across all their bulbs, so big jumps are
+// normal. Only a frame a few numbers behind the last applied change of its
+// kind, arriving shortly after it, was overtaken on the way.
+#define LIFX_SEQUENCE_REORDER_WINDOW 16
+#define LIFX_SEQUENCE_REORDER_MS 250
+// Largest response kept for retransmissions (LightState; SetColor and
+// SetPower answers fit, bigger ones are encoded from current state again)
+#define LIFX_SEQUENCE_RESPONSE_MAX sizeof(LifxPayloadLightState)
+struct LifxSourceHistory {
+	uint32_t source;    // 0 = free slot
+	uint32_t last_ms;
+	uint32_t color_ms;
+	uint32_t power_ms;
+	// Last frame seen per sequence number (round robin), payload hashed so a
+	// client that reuses one sequence for every frame is not mistaken for a
+	// retransmitting one
+	struct {
+		uint32_t payload_hash;
+		uint16_t type;
+		uint8_t sequence;
+	} recent[LIFX_SEQUENCE_RECENT];
+	uint8_t recent_count;
+	uint8_t recent_next;
+	uint8_t color_seq;  // last applied SetColor/SetWaveform(Optional)
+	uint8_t power_seq;  // last applied SetPower/LightSetPower
+	uint8_t valid;      // LIFX_HISTORY_* bits
+	// What the newest applied SET was answered with, so a retransmission
+	// gets the reply the client missed rather than state changed since
+	uint8_t response_sequence;
+	uint16_t response_to;   // type of that SET, 0 = nothing cached
+	uint16_t response_type;
+	uint8_t response_size;
+	uint8_t response[LIFX_SEQUENCE_RESPONSE_MAX];
+};
+const uint8_t LIFX_HISTORY_COLOR = 0x01;
+const uint8_t LIFX_HISTORY_POWER = 0x02;
+
+class LifxDevice;
+class LifxDeviceSet;
+
+// Dispatch table entry flags
+const uint8_t LIFX_DISPATCH_MUTATES = 0x01;       // setter: respond only if res_required
+const uint8_t LIFX_DISPATCH_IGNORED = 0x02;       // response from another bulb, ignored
+const uint8_t LIFX_DISPATCH_FAST = 0x04;          // GET answerable from the state snapshot
+#define LIFX_DISPATCH_MAX_ENTRIES 64
+
+// Waveform frame scheduling: aim for this many frames per cycle, limited by
+// the configured fps, and never render slower than LIFX_WAVEFORM_MAX_INTERVAL_MS
+#define LIFX_WAVEFORM_SAMPLES_PER_CYCLE 64
+#define LIFX_WAVEFORM_MAX_INTERVAL_MS 100
+// GetService requests waiting out their discovery jitter at once
+#define LIFX_DISCOVERY_SLOTS 4
+// Virtual devices sharing one UDP listener (LifxDeviceSet)
+#define LIFX_MAX_VIRTUAL_DEVICES 8
+
+// One row of LifxDevice::DISPATCH_TABLE, see lifx_device.cpp
+struct LifxDispatchEntry {
+	uint16_t type;
+	uint16_t min_payload;
+	void (LifxDevice::*apply)(const LifxPacketView &request, const LifxPeer &peer);
+	uint16_t (LifxDevice::*encode)(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out);
+	uint16_t response_type;
+	uint8_t flags;
+};
+
+// Portable LIFX bulb: owns the emulated device state and the packet
+// decode/dispatch/encode path. Has no ESPHome or Arduino dependencies; all
+// I/O goes through the interfaces in lifx_platform.h so the same code runs
+// on the ESP (via LifxEmulation) and in the host benchmark.
+class LifxDevice
+{
+public:
+	~LifxDevice()
+	{
+		delete[] zones_;
+		delete[] zones_applied_;
+		delete[] tile_fb_;
+	}
+
+	// ---- Platform wiring ----
+	void set_transport(LifxTransport *transport) { this->transport_ = transport; }
+	void set_light_output(LifxLightOutput *light) { this->light_ = light; }
+	void set_clock(LifxClock *clock) { this->clock_ = clock; }
+	void set_storage(LifxStorage *storage) { this->storage_ = storage; }
+	void set_zone_output(LifxZoneOutput *zones) { this->zone_output_ = zones; }
+	void set_mac(const uint8_t *arg) { memcpy(mac, arg, sizeof(mac)); }
+	const uint8_t *get_mac() const { return mac; }
+	void set_debug(bool debug) { this->debug_ = debug; }
+	// Typical frames buffered between the UDP callback and loop() (the arena is
+	// LIFX_QUEUE_BYTES_PER_FRAME bytes per entry); 0 handles them inline. The
+	// queue belongs to the LifxDeviceSet and is sized by its first device.
+	void set_rx_queue_size(size_t size) { this->rx_queue_size_ = size; }
+	// MultiZone (strip) mode when > 0, rendered through the zone output; call before begin()
+	void set_zone_count(uint16_t count) { this->zone_count_ = count > LIFX_MAX_ZONES ? LIFX_MAX_ZONES : count; }
+	uint16_t get_zone_count() const { return zone_count_; }
+	// Tile (matrix) mode when both are > 0, rendered row by row through the zone
+	// output; call before begin()
+	void set_tile_size(uint8_t width, uint8_t height)
+	{
+		this->tile_width_ = width > LIFX_MAX_TILE_SIDE ? LIFX_MAX_TILE_SIDE : width;
+		this->tile_height_ = height > LIFX_MAX_TILE_SIDE ? LIFX_MAX_TILE_SIDE : height;
+	}
+	// Framebuffers addressable by Set64/CopyFrameBuffer fb_index, including the shown one
+	void set_tile_framebuffers(uint8_t count)
+	{
+		this->tile_fb_count_ = count < 1 ? 1 : count > LIFX_MAX_TILE_FRAMEBUFFERS ? LIFX_MAX_TILE_FRAMEBUFFERS : count;
+	}
+	uint8_t get_tile_width() const { return tile_width_; }
+	uint16_t get_tile_pixels() const { return tile_width_ * tile_height_; }
+	// Highest waveform frame rate; short periods render up to this, long ones slower
+	void set_waveform_fps(uint8_t fps) { this->waveform_fps_ = fps ? fps : 1; }
+	// Frame rate of SetColor/SetPower fades on single lights, interpolated in
+	// HSBK here; 0 hands the duration to the light output instead
+	void set_transition_fps(uint8_t fps) { this->transition_fps_ = fps; }
+	// Window GetService replies are spread over, at a MAC-seeded offset, so a
+	// room full of bulbs doesn't answer a broadcast all at once; 0 replies at
+	// once. Needs the rx queue, replies are sent from loop().
+	void set_discovery_jitter(uint32_t ms) { this->discovery_jitter_ms_ = ms; }
+	// Binary trace of the last records frames/responses (split between the UDP
+	// task and loop()); 0 disables it. While it runs, debug no longer logs
+	// every packet. Call before begin().
+	void set_trace_size(uint16_t records) { this->trace_size_ = records; }
+	bool is_tracing() const { return trace_.enabled(); }
+	// debug on and no trace running: every packet is logged
+	bool is_logging_packets() const { return log_packets_(); }
+	uint32_t get_trace_written() const { return trace_.written(TRACE_LANE_NETWORK) + trace_.written(TRACE_LANE_LOOP); }
+	// Writes the trace to the log as hex lines for host/lifx_trace.py
+	void dump_trace();
+	// Quiet time after the last persisted change before it is written to flash
+	void set_save_delay(uint32_t ms) { this->save_delay_ms_ = ms; }
+
+	void set_bulb_label(const char *arg) { strncpy(bulbLabel, arg, sizeof(bulbLabel) - 1); }
+
+	void set_bulb_location(const char *arg) { strncpy(bulbLocation, arg, sizeof(bulbLocation) - 1); }
+	void set_bulb_location_guid(const char *arg) { strncpy(bulbLocationGUID, arg, sizeof(bulbLocationGUID) - 1); bulbLocationGUID[sizeof(bulbLocationGUID) - 1] = '\0'; }
+	void set_bulb_location_time(uint64_t arg) { bulbLocationTime = arg; }
+
+	void set_bulb_group(const char *arg) { strncpy(bulbGroup, arg, sizeof(bulbGroup) - 1); }
+	void set_bulb_group_guid(const char *arg) { strncpy(bulbGroupGUID, arg, sizeof(bulbGroupGUID) - 1); bulbGroupGUID[sizeof(bulbGroupGUID) - 1] = '\0'; }
+	void set_bulb_group_time(uint64_t arg) { bulbGroupTime = arg; }
+
+	const char *get_bulb_label() const { return bulbLabel; }
+	const char *get_bulb_location() const { return bulbLocation; }
+	const char *get_bulb_location_guid() const { return bulbLocationGUID; }
+	const char *get_bulb_group() const { return bulbGroup; }
+	const char *get_bulb_group_guid() const { return bulbGroupGUID; }
+	uint32_t get_rx_not_for_us() const { return rx_not_for_us; }
+	uint32_t get_light_applied() const { return light_applied_; }
+	uint32_t get_light_coalesced() const { return light_coalesced_; }
+	uint32_t get_rx_queue_dropped() const { return rx_queue_dropped_; }
+	uint32_t get_rx_fast() const { return rx_fast_; }
+	uint32_t get_snapshot_encodes() const { return snapshot_encodes_; }
+	uint32_t get_save_requests() const { return save_requests_; }
+	uint32_t get_save_writes() const { return save_writes_; }
+	uint32_t get_save_unchanged() const { return save_unchanged_; }
+	uint32_t get_waveform_frames() const { return waveform_frames_; }
+	uint32_t get_waveform_late() const { return waveform_late_; }
+	uint32_t get_waveform_missed() const { return waveform_missed_; }
+	uint32_t get_transition_frames() const { return transition_frames_; }
+	uint32_t get_discovery_deferred() const { return discovery_deferred_; }
+	uint32_t get_discovery_sent() const { return discovery_sent_; }
+	uint32_t get_rx_duplicates() const { return rx_duplicates_; }
+	uint32_t get_rx_stale() const { return rx_stale_; }
+	const LifxLatencyHistogram &get_latency(LifxLatencyStage stage) const { return latency_[stage]; }
+	// Addressed to us, including runts and frames that are later dropped
+	uint32_t get_rx_packets(LifxPacketFamily family) const { return rx_family_[family]; }
+
+	// ---- Persistence ----
+	void export_state(LifxPersistentState &state) const;
+	// Cloud state is always restored; label/location/group only if restore_identity
+	void import_state(const LifxPersistentState &state, bool restore_identity);
+	// Writes a pending change now instead of waiting for the save delay
+	void flush_state();
+
+	// ---- Lifecycle ----
+	void begin();
+	void loop();
+
+	// Entry point for one received UDP datagram. Safe to call from the network
+	// task while loop() runs on the main task as long as the rx queue is enabled,
+	// which takes a LifxDeviceSet: a device outside one handles frames inline.
+	void handle_datagram(const uint8_t *data, uint32_t len, const LifxPeer &peer);
+
+	// ---- Protocol path ----
+	void handleRequest(const LifxPacketView &request, const LifxPeer &peer);
+	unsigned int sendPacket(LifxPacket &pkt, const LifxPeer &peer);
+	void buildLightStateData(byte *out);
+
+	// ---- Dispatch table and per-entry hit counters ----
+	static const LifxDispatchEntry DISPATCH_TABLE[];
+	static const size_t DISPATCH_TABLE_SIZE;
+	static int find_dispatch_entry(uint16_t type);
+	uint32_t get_dispatch_hits(size_t index) const { return dispatch_hits_[index] + fast_dispatch_hits_[index]; }
+	uint32_t get_dispatch_unknown() const { return dispatch_unknown_; }
+	uint32_t get_dispatch_short() const { return dispatch_short_; }
+	void log_dispatch_stats();
+
+protected:
+	friend class LifxDeviceSet; // wires set_ and hands it queued frames
+	LifxTransport *transport_{nullptr};
+	LifxLightOutput *light_{nullptr};
+	LifxClock *clock_{nullptr};
+	LifxStorage *storage_{nullptr};
+	LifxZoneOutput *zone_output_{nullptr};
+	bool debug_{false};
+
+	byte mac[6] = {};
+
+	// ---- Network task -> main loop handoff ----
+	size_t rx_queue_size_{0};
+	LifxDeviceSet *set_{nullptr}; // owns the rx queue, see LifxDeviceSet::add()
+	uint8_t set_index_{0};
+	uint32_t rx_queue_dropped_{0};
+	uint32_t rx_fast_{0};  // GETs answered directly from the callback
+	// Written only by the main loop; read by the callback through read_snapshot_()
+	LifxStateSnapshot snapshot_{};
+	std::atomic<uint32_t> snapshot_seq_{0};
+	// Bumped whenever a field behind the cached payloads changes:
+	// color/power/label/tags for light, location/group for identity
+	uint32_t light_version_{1};
+	uint32_t identity_version_{1};
+	uint32_t snapshot_encodes_{0};
+
+	char bulbLabel[32] = "";
+	char bulbLocation[32] = "ESPHome";
+	char bulbLocationGUID[37] = "b49bed4d-77b0-05a3-9ec3-be93d9582f1f";
+	uint64_t bulbLocationTime = 1553350342028441856;
+
+	char bulbGroup[32] = "ESPHome";
+	char bulbGroupGUID[37] = "bd93e53d-2014-496f-8cfd-b8886f766d7a";
+	uint64_t bulbGroupTime = 1600213602318000000;
+
+	uint8_t cloudStatus = 0x00;
+	byte cloudBrokerUrl[33] = {0x00}; // Unclouded response
+	unsigned char cloudAuthResponse[32] = {0x00}; // Unclouded response
+	byte authResponse[56] = {0x00};
+
+	// initial bulb values - warm white!
+	uint16_t power_status = 65535;
+	uint16_t hue = 0;
+	uint16_t sat = 0;
+	uint16_t bri = 65535;
+	uint16_t kel = 2700;
+	long dim = 0;
+	uint32_t dur = 0;
+
+	// Waveform animation state, one effect per HSBK channel. Each channel's
+	// frames are due on its own grid (PULSE: on its edges) so sampling stays
+	// phase locked; a frame samples every running channel.
+	LifxWaveformChannel waveform_channels_[WAVEFORM_CHANNELS];
+	bool waveform_active_{false}; // any channel running
+	uint8_t waveform_fps_{20};
+	uint32_t waveform_frames_{0};
+	uint32_t waveform_late_{0};   // rendered more than half an interval after they were due
+	uint32_t waveform_missed_{0}; // grid slots skipped because loop() came too late
+	// Outgoing datagrams: header template built once in begin(), payload after
+	// it. fast_tx_buf_ belongs to the UDP callback, tx_buf_ to the main loop.
+	// Shared by every device: replies are built and sent one at a time, by
+	// loop() on the main task and by the single UDP callback respectively
+	static uint8_t tx_buf_[LifxPacketSize + LIFX_MAX_RESPONSE_PAYLOAD];
+	static uint8_t fast_tx_buf_[LifxPacketSize + LIFX_MAX_FAST_RESPONSE_PAYLOAD];
+	uint64_t tx_timestamp_{0};
+	uint32_t tx_bytes = 0;
+	uint32_t tx_bytes_fast_ = 0;
+	uint32_t rx_bytes = 0;
+	uint32_t rx_not_for_us = 0; // frames dropped by the target filter
+
+	// MultiZone state. zones_ is the staging buffer that Set*ColorZones write
+	// and Get*ColorZones report; it is copied to zones_applied_ (what is shown)
+	// on APPLY/APPLY_ONLY.
+	uint16_t zone_count_{0};
+	LifxHSBK *zones_{nullptr};
+	LifxHSBK *zones_applied_{nullptr};
+	bool zones_follow_light_{true}; // SetColor/waveforms paint the whole strip or tile
+	// Built-in MultiZone effect as last set (reported by GetMultiZoneEffect).
+	// MOVE rotates zones_applied_ in place; zone_effect_offset_ is how many
+	// zones it has moved, so an APPLY during the effect lands in phase.
+	LifxPayloadMultiZoneEffect zone_effect_{};
+	uint32_t zone_effect_start_{0};
+	uint32_t zone_effect_next_{0};  // next frame, ms after zone_effect_start_
+	uint16_t zone_effect_offset_{0};
+
+	// Tile state: tile_fb_count_ framebuffers of width x height pixels, row
+	// major. Framebuffer 0 is what is shown; clients draw into a back buffer
+	// with Set64 and present it with CopyFrameBuffer so frames never tear.
+	uint8_t tile_width_{0};
+	uint8_t tile_height_{0};
+	uint8_t tile_fb_count_{2};
+	LifxHSBK *tile_fb_{nullptr};
+	float tile_user_x_{0};
+	float tile_user_y_{0};
+	// On-device tile effect as last set (reported by GetTileEffect), drawn
+	// into framebuffer 0 from loop()
+	LifxTileEffectSettings tile_effect_{};
+	uint32_t tile_effect_start_{0};
+	uint32_t tile_effect_next_{0};  // next frame, ms after tile_effect_start_
+
+	// Single light fades. shown_ is what the light output last got (brightness
+	// 0 while off), so a new target mid-fade carries on from where it is.
+	uint8_t transition_fps_{20};
+	bool transition_active_{false};
+	LifxHSBK transition_from_{};
+	LifxHSBK transition_to_{};
+	uint16_t transition_power_{0};    // power once the fade is done
+	uint32_t transition_start_{0};
+	uint32_t transition_ms_{0};
+	uint32_t transition_next_{0};     // next frame, ms after transition_start_
+	uint32_t transition_frames_{0};
+	LifxHSBK shown_{0, 0, 0, 2700};
+
+	// Jittered GetService replies: the request header is kept until its slot is due
+	struct PendingDiscovery {
+		bool active;
+		uint32_t due;
+		LifxPeer peer;
+		uint8_t header[LifxPacketSize];
+	};
+	uint32_t discovery_jitter_ms_{0};
+	PendingDiscovery discovery_[LIFX_DISCOVERY_SLOTS] = {};
+	uint8_t discovery_pending_{0};
+	uint32_t discovery_deferred_{0};
+	uint32_t discovery_sent_{0};
+
+	// Light updates are coalesced until the next loop()
+	bool light_dirty_{false};
+	uint32_t light_applied_{0};
+	uint32_t light_coalesced_{0}; // updates superseded before they were applied
+
+	// Persistence is deferred to loop(): save_state_() only marks it dirty
+	uint32_t save_delay_ms_{5000};
+	bool save_pending_{false};
+	uint32_t save_requested_at_{0};
+	uint32_t saved_hash_{0};     // hash of the last state written (or restored)
+	uint32_t save_requests_{0};
+	uint32_t save_writes_{0};
+	uint32_t save_unchanged_{0}; // pending saves dropped because nothing changed
+
+	// SETs repeated by a client, or overtaken by a newer one, are acked again
+	// but not applied
+	LifxSourceHistory sources_[LIFX_SEQUENCE_SOURCES] = {};
+	uint32_t rx_duplicates_{0};
+	uint32_t rx_stale_{0};
+
+	LifxLatencyHistogram latency_[LATENCY_STAGES];
+	uint16_t trace_size_{0};
+	LifxTraceRing trace_;
+	bool log_packets_() const { return debug_ && !trace_.enabled(); }
+	uint32_t rx_family_[PACKET_FAMILIES] = {};  // written by the UDP task only
+
+	// Split like tx_bytes/tx_bytes_fast_ so each counter has a single writer:
+	// the fast path runs in the UDP task while queued requests dispatch in loop()
+	uint32_t dispatch_hits_[LIFX_DISPATCH_MAX_ENTRIES] = {};
+	uint32_t fast_dispatch_hits_[LIFX_DISPATCH_MAX_ENTRIES] = {};
+	uint32_t dispatch_unknown_{0};
+	uint32_t dispatch_short_{0};
+
+	byte site_mac[6] = {0x4C, 0x49, 0x46, 0x58, 0x56, 0x32}; // spells out "LIFXV2"
+
+	// tags for this bulb, seemingly unused on current real bulbs
+	char bulbTags[LifxBulbTagsLength] = {
+		0, 0, 0, 0, 0, 0, 0, 0};
+	char bulbTagLabels[LifxBulbTagLabelsLength] = "";
+
+	// real guids are stored as byte arrays instead of a char string representation
+	byte bulbGroupGUIDb[16] = {};
+	byte bulbLocationGUIDb[16] = {};
+	// Guids in packets come in a bizarre mix of big and little endian
+	uint8_t guidSeq[16] = {3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15};
+
+	bool is_addressed_to_us_(const uint8_t *data) const;
+	LifxTraceEvent receive_(const uint8_t *data, uint32_t len, const LifxPeer &peer);
+	void dispatch_(const LifxPacketView &request, const LifxPeer &peer);
+	bool replayed_(const LifxPacketView &request, LifxSourceHistory *&history);
+	void cache_response_(LifxSourceHistory &history, const LifxPacketView &request, const LifxPacket *response);
+	uint32_t resend_response_(const LifxSourceHistory &history, const LifxPacketView &request, LifxPacket &response,
+		const LifxPeer &peer);
+	void log_short_payload_(const LifxPacketView &request);
+	void save_state_();
+	uint32_t state_hash_(LifxPersistentState &state) const;
+	uint64_t lifx_timestamp_();
+	LifxFrameQueue *rx_queue_() const;
+	void publish_snapshot_();
+	bool read_snapshot_(LifxStateSnapshot &out) const;
+	bool answer_fast_(int index, const LifxPacketView &request, const LifxPeer &peer);
+	void init_response_(LifxPacket &response, const LifxPacketView &request, uint8_t *frame, uint64_t timestamp);
+	uint32_t respond_(const LifxDispatchEntry &entry, const LifxPacketView &request,
+		const LifxStateSnapshot &state, LifxPacket &response, const LifxPeer &peer);
+	uint32_t acknowledge_(const LifxPacketView &request, LifxPacket &response, const LifxPeer &peer);
+	bool defer_discovery_(const LifxPacketView &request, const LifxPeer &peer);
+	void send_due_discovery_();
+	void send_response_(const LifxPacketView &request, const LifxPeer &peer, uint16_t type, uint16_t protocol, uint16_t size);
+	void send_zone_range_(const LifxPacketView &request, const LifxPeer &peer, uint8_t start, uint8_t end);
+	void send_ext_zones_(const LifxPacketView &request, const LifxPeer &peer);
+	void commit_zones_(uint8_t apply, uint32_t duration);
+	void rotate_applied_zones_(uint16_t shift);
+	void render_zone_effect_();
+	void stop_zone_effect_();
+	LifxHSBK *tile_framebuffer_(uint8_t fb_index) { return tile_fb_ + fb_index * get_tile_pixels(); }
+	void present_tile_(uint32_t duration);
+	void render_tile_effect_();
+	void stop_tile_effect_();
+	void setLight();
+	void flushLight();
+	void apply_light_(const LifxHSBK &color, uint16_t power, uint32_t duration);
+	void start_transition_();
+	LifxHSBK transition_at_(uint32_t elapsed) const;
+	void render_transition_();
+	void renderWaveform();
+	uint32_t next_waveform_frame_(const LifxWaveformChannel &channel, uint32_t elapsed) const;
+	uint16_t &channel_value_(uint8_t channel);
+	void startWaveform(uint8_t channels, const LifxPayloadSetWaveform &wave);
+	// apply: false when the caller calls setLight() itself right after
+	void stopWaveform(bool restore, bool apply = true);
+
+	// ---- Message handlers referenced from DISPATCH_TABLE ----
+	uint16_t encode_service_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out);
+	uint16_t encode_host_firmware_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out);
+	uint16_t encode_wifi_firmware_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out);
+	uint16_t encode_wifi_info_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out);
+	void apply_power_(const LifxPacketView &request, const LifxPeer &peer);
+	uint16_t encode_power_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out);
+	void apply_label_(const LifxPacketView &request, const LifxPeer &peer);
+	uint16_t encode_label_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out);
+	void apply_tags_(const LifxPacketView &request, const LifxPeer &peer);
+	uint16_t encode_tags_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out);
+	void apply_tag_labels_(const LifxPacketView &request, const LifxPeer &peer);
+	uint16_t encode_tag_labels_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out);
+	uint16_t encode_version_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out);
+	void apply_location_(const LifxPacketView &request, const LifxPeer &peer);
+	uint16_t encode_location_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out);
+	void apply_group_(const LifxPacketView &request, const LifxPeer &peer);
+	uint16_t encode_group_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out);
+	void apply_auth_(const LifxPacketView &request, const LifxPeer &peer);
+	uint16_t encode_auth_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out);
+	uint16_t encode_echo_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out);
+	uint16_t encode_light_state_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out);
+	void apply_color_(const LifxPacketView &request, const LifxPeer &peer);
+	void apply_waveform_(const LifxPacketView &request, const LifxPeer &peer);
+	void apply_waveform_optional_(const LifxPacketView &request, const LifxPeer &peer);
+	void apply_cloud_state_(const LifxPacketView &request, const LifxPeer &peer);
+	uint16_t encode_cloud_state_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out);
+	void apply_cloud_auth_(const LifxPacketView &request, const LifxPeer &peer);
+	uint16_t encode_cloud_auth_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out);
+	void apply_cloud_broker_(const LifxPacketView &request, const LifxPeer &peer);
+	uint16_t encode_cloud_broker_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out);
+	void apply_color_zones_(const LifxPacketView &request, const LifxPeer &peer);
+	void send_color_zones_(const LifxPacketView &request, const LifxPeer &peer);
+	void apply_ext_color_zones_(const LifxPacketView &request, const LifxPeer &peer);
+	void send_ext_color_zones_(const LifxPacketView &request, const LifxPeer &peer);
+	void apply_zone_effect_(const LifxPacketView &request, const LifxPeer &peer);
+	uint16_t encode_zone_effect_(const LifxPacketView &request, const LifxStateSnapshot &state, byte *out);
+	void send_device_chain_(const LifxPacketView &request, const LifxPeer &peer);
+	void apply_user_position_(const LifxPacketView &request, const LifxPeer &peer);
+	void send_tile_state64_(const LifxPacketView &request, const LifxPeer &peer);
+	void apply_tile_state64_(const LifxPacketView &request, const LifxPeer &peer);
+	void send_tile_effect_(const LifxPacketView &request, const LifxPeer &peer);
+	void apply_tile_effect_(const LifxPacketView &request, const LifxPeer &peer);
+	void apply_copy_frame_buffer_(const LifxPacketView &request, const LifxPeer &peer);
+	void send_trace_(const LifxPacketView &request, const LifxPeer &peer);
+};
+
+// Virtual MAC of the index'th device on one ESP: index 0 keeps the hardware
+// address, the rest set the locally administered bit and add index to the
+// lower three bytes.
+void lifx_virtual_mac(const uint8_t *base, uint8_t index, uint8_t *out);
+
+// Several LifxDevices behind one socket. A frame for a specific target goes
+// to that device only; tagged and broadcast frames (discovery) go to each
+// of them, so every virtual bulb answers GetService once.
+class LifxDeviceSet
+{
+public:
+	// Call after the device's begin(); returns false when the set is full
+	bool add(LifxDevice *device);
+	uint8_t size() const { return count_.load(std::memory_order_acquire); }
+	LifxDevice *get(uint8_t index) const { return devices_[index]; }
+
+	// Same contract as LifxDevice::handle_datagram. Returns the device that
+	// took the frame (the first one for broadcasts), null while empty
+	LifxDevice *handle_datagram(const uint8_t *data, uint32_t len, const LifxPeer &peer);
+	// Main task: hands queued frames to their devices. Each device's loop()
+	// calls this, so whichever runs first drains the queue for all of them.
+	void drain();
+	// The shared rx queue, null when the first device's rx_queue_size was 0
+	LifxFrameQueue *rx_queue() { return rx_queue_.enabled() ? &rx_queue_ : nullptr; }
+
+protected:
+	// One queue for the listener; frames are tagged with the device they are for
+	LifxFrameQueue rx_queue_;
+	size_t rx_queue_size_{0};
+	LifxDevice *devices_[LIFX_MAX_VIRTUAL_DEVICES] = {};
+	// Devices are added on the main task while the network task may already be dispatching
+	std::atomic<uint8_t> count_{0};
+};
+
+} // namespace lifx_emulation
+} // namespace esphome
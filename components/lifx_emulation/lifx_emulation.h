@@ -5,6 +5,9 @@
 #include "esphome/core/log.h"
 #include "esphome/core/preferences.h"
 #include "esphome/components/light/light_state.h"
+#include "esphome/components/light/addressable_light.h"
+#include "esphome/components/sensor/sensor.h"
+#include "esphome/components/text_sensor/text_sensor.h"
 #include "esphome/components/time/real_time_clock.h"
 #ifdef USE_ESP8266
 #include <ESP8266WiFi.h>
@@ -13,142 +16,154 @@
 #endif
 #include <ESPAsyncUDP.h>
 
-#include "lifx_protocol.h"
+#include "lifx_color.h"
+#include "lifx_device.h"
 
 namespace esphome {
 namespace lifx_emulation {
 
-struct LifxPersistentState {
-	uint32_t yaml_hash;
-	char bulbLabel[32];
-	char bulbLocation[32];
-	char bulbLocationGUID[37];
-	uint64_t bulbLocationTime;
-	char bulbGroup[32];
-	char bulbGroupGUID[37];
-	uint64_t bulbGroupTime;
-	// Cloud state (always restored, independent of yaml_hash)
-	uint8_t cloudStatus;
-	uint8_t cloudBrokerUrl[33];
-	uint8_t cloudAuthResponse[32];
-	uint8_t authResponse[56];
-};
-
-class LifxEmulation : public Component
+// ESPHome glue around the portable LifxDevice: provides the UDP transport,
+// light (or addressable strip) output, clock and flash storage it runs on.
+class LifxEmulation : public Component,
+					  public LifxTransport,
+					  public LifxLightOutput,
+					  public LifxZoneOutput,
+					  public LifxClock,
+					  public LifxStorage
 {
 public:
 	// ---- Setters called by generated code (from __init__.py to_code()) ----
 	void set_color_led(light::LightState *light) { this->color_led_ = light; }
 	void set_white_led(light::LightState *light) { this->white_led_ = light; }
 	void set_rgbww_led(light::LightState *light) { this->rgbww_led_ = light; }
+	void set_strip_led(light::LightState *light) { this->strip_led_ = light; }
+	// 0 = one zone per LED
+	void set_zones(uint16_t zones) { this->zones_ = zones; }
+	// A matrix is driven through the same addressable output as a strip
+	void set_tile_led(light::LightState *light) { this->strip_led_ = light; this->tile_mode_ = true; }
+	void set_tile_size(uint8_t width, uint8_t height) { device_.set_tile_size(width, height); }
+	void set_tile_serpentine(bool serpentine) { this->tile_serpentine_ = serpentine; }
+	void set_tile_framebuffers(uint8_t count) { device_.set_tile_framebuffers(count); }
 	void set_time(time::RealTimeClock *time_rtc) { this->ha_time_ = time_rtc; }
-
-	void set_debug(bool debug) { this->debug_ = debug; }
-
-	void set_bulb_label(const char *arg) { strncpy(bulbLabel, arg, sizeof(bulbLabel) - 1); }
-
-	void set_bulb_location(const char *arg) { strncpy(bulbLocation, arg, sizeof(bulbLocation) - 1); }
-	void set_bulb_location_guid(const char *arg) { strncpy(bulbLocationGUID, arg, sizeof(bulbLocationGUID) - 1); bulbLocationGUID[sizeof(bulbLocationGUID) - 1] = '\0'; }
-	void set_bulb_location_time(uint64_t arg) { bulbLocationTime = arg; }
-
-	void set_bulb_group(const char *arg) { strncpy(bulbGroup, arg, sizeof(bulbGroup) - 1); }
-	void set_bulb_group_guid(const char *arg) { strncpy(bulbGroupGUID, arg, sizeof(bulbGroupGUID) - 1); bulbGroupGUID[sizeof(bulbGroupGUID) - 1] = '\0'; }
-	void set_bulb_group_time(uint64_t arg) { bulbGroupTime = arg; }
+	// Position among the lifx_emulation blocks; picks the virtual MAC and flash slot
+	void set_device_index(uint8_t index) { this->device_index_ = index; }
+
+	// 16-bit HSBK to float color instead of the 8-bit hsb2rgb() path
+	void set_precise_color(bool precise) { this->precise_color_ = precise; }
+	void set_debug(bool debug) { this->debug_ = debug; this->device_.set_debug(debug); }
+	void set_rx_queue_size(uint16_t size) { device_.set_rx_queue_size(size); }
+	void set_save_delay(uint32_t ms) { device_.set_save_delay(ms); }
+	void set_waveform_fps(uint8_t fps) { device_.set_waveform_fps(fps); }
+	void set_transition_fps(uint8_t fps) { device_.set_transition_fps(fps); }
+	void set_discovery_jitter(uint32_t ms) { device_.set_discovery_jitter(ms); }
+	void set_trace_size(uint16_t records) { device_.set_trace_size(records); }
+	// Logs the packet trace for host/lifx_trace.py, e.g. from a button lambda
+	void dump_trace() { device_.dump_trace(); }
+
+	// ---- Hot path statistics (optional `stats:` block) ----
+	void set_stats_interval(uint32_t ms) { this->stats_interval_ = ms; }
+	// p99 of each stage over the last interval, in us
+	void set_latency_sensor(LifxLatencyStage stage, sensor::Sensor *sensor) { this->latency_sensors_[stage] = sensor; }
+	void set_packet_rate_sensor(sensor::Sensor *sensor) { this->packet_rate_sensor_ = sensor; }
+	void set_dropped_sensor(sensor::Sensor *sensor) { this->dropped_sensor_ = sensor; }
+	void set_coalesced_sensor(sensor::Sensor *sensor) { this->coalesced_sensor_ = sensor; }
+	// p50/p99 per stage and packets/sec per message family in one line
+	void set_stats_summary_sensor(text_sensor::TextSensor *sensor) { this->stats_summary_sensor_ = sensor; }
+
+	void set_bulb_label(const char *arg) { device_.set_bulb_label(arg); }
+
+	void set_bulb_location(const char *arg) { device_.set_bulb_location(arg); }
+	void set_bulb_location_guid(const char *arg) { device_.set_bulb_location_guid(arg); }
+	void set_bulb_location_time(uint64_t arg) { device_.set_bulb_location_time(arg); }
+
+	void set_bulb_group(const char *arg) { device_.set_bulb_group(arg); }
+	void set_bulb_group_guid(const char *arg) { device_.set_bulb_group_guid(arg); }
+	void set_bulb_group_time(uint64_t arg) { device_.set_bulb_group_time(arg); }
 
 	// ---- ESPHome Component lifecycle ----
 	void setup() override;
 	void loop() override;
+	// Don't lose a change still waiting for its save delay on reboot/OTA
+	void on_shutdown() override { device_.flush_state(); }
 
 	// Run after WiFi is established so the UDP listener can bind successfully
 	float get_setup_priority() const override { return setup_priority::AFTER_WIFI; }
 
+	// ---- LifxDevice platform interfaces ----
+	void send(const LifxPeer &peer, const uint8_t *data, size_t len) override;
+	float signal_mw() override;
+	void apply(const LifxLightCommand &cmd) override;
+	void apply_zones(const LifxHSBK *zones, uint16_t count, uint16_t power, uint32_t duration) override;
+	uint32_t millis() override { return ::millis(); }
+	uint32_t micros() override { return ::micros(); }
+	uint64_t utc_seconds() override { return this->ha_time_->utcnow().timestamp; }
+	void save(const LifxPersistentState &state) override;
+
 private:
 	// ---- Member pointers set via setters ----
 	light::LightState *color_led_{nullptr};
 	light::LightState *white_led_{nullptr};
 	light::LightState *rgbww_led_{nullptr};
+	light::LightState *strip_led_{nullptr};
+	uint16_t zones_{0};
+	bool tile_mode_{false};
+	bool tile_serpentine_{false};
+	bool precise_color_{false};
+	// Channels of rgbww_led or white_led, set up for precise_color whites
+	LifxWhiteTraits white_traits_{};
 	time::RealTimeClock *ha_time_{nullptr};
 	bool debug_{false};
+	uint8_t device_index_{0};
 
 	bool is_combined_mode() { return this->rgbww_led_ != nullptr; }
-
-	byte mac[6] = {};
-
-	char bulbLabel[32] = "";
-	char bulbLocation[32] = "ESPHome";
-	char bulbLocationGUID[37] = "b49bed4d-77b0-05a3-9ec3-be93d9582f1f";
-	uint64_t bulbLocationTime = 1553350342028441856;
-
-	char bulbGroup[32] = "ESPHome";
-	char bulbGroupGUID[37] = "bd93e53d-2014-496f-8cfd-b8886f766d7a";
-	uint64_t bulbGroupTime = 1600213602318000000;
-
-	uint8_t cloudStatus = 0x00;
-	byte cloudBrokerUrl[33] = {0x00}; // Unclouded response
-	unsigned char cloudAuthResponse[32] = {0x00}; // Unclouded response
-	byte authResponse[56] = {0x00};
+	bool is_strip_mode() { return this->strip_led_ != nullptr && !this->tile_mode_; }
+	bool is_tile_mode() { return this->tile_mode_; }
+
+	// Zones (or tile pixels) last handed to apply_zones(), redrawn once the strip has turned on
+	const LifxHSBK *shown_zones_{nullptr};
+	uint16_t shown_count_{0};
+	bool zones_redraw_{false};
+	// Converted once per render, then spread over the LEDs. Scratch space that
+	// instances take turns with in loop(), so one copy serves them all.
+	static LifxRGB shown_rgb_[LIFX_MAX_TILE_SIDE * LIFX_MAX_TILE_SIDE];
+	static_assert(LIFX_MAX_TILE_SIDE * LIFX_MAX_TILE_SIDE >= LIFX_MAX_ZONES, "shown_rgb_ must hold every zone");
+
+	LifxDevice device_;
+
+	// Stats are published per interval, as the difference to the counts last published
+	uint32_t stats_interval_{0};
+	sensor::Sensor *latency_sensors_[LATENCY_STAGES] = {};
+	sensor::Sensor *packet_rate_sensor_{nullptr};
+	sensor::Sensor *dropped_sensor_{nullptr};
+	sensor::Sensor *coalesced_sensor_{nullptr};
+	text_sensor::TextSensor *stats_summary_sensor_{nullptr};
+	uint32_t stats_latency_prev_[LATENCY_STAGES][LIFX_LATENCY_BUCKETS] = {};
+	uint32_t stats_packets_prev_[PACKET_FAMILIES] = {};
+	uint32_t stats_published_at_{0};
+	void publish_stats_();
 
 	static const int maxColor = 255;
-	// initial bulb values - warm white!
-	uint16_t power_status = 65535;
-	uint16_t hue = 0;
-	uint16_t sat = 0;
-	uint16_t bri = 65535;
-	uint16_t kel = 2700;
-	long dim = 0;
-	uint32_t dur = 0;
-
-	// Waveform parameters (from SetWaveform / SetWaveformOptional)
-	uint8_t trans = 0;       // transient: 1 = return to original after effect
-	uint32_t period = 0;     // milliseconds per cycle
-	float cycles = 0;        // number of cycles (0 = infinite)
-	int16_t skew_ratio = 0;  // PULSE duty cycle (-32768 to 32767)
-	uint8_t waveform = 0;    // LifxWaveform enum
-
-	// Waveform animation state
-	bool waveform_active_{false};
-	unsigned long waveform_start_{0};
-	unsigned long waveform_last_update_{0};
-	uint16_t orig_hue_{0}, orig_sat_{0}, orig_bri_{0}, orig_kel_{2700};
-	uint16_t wave_hue_{0}, wave_sat_{0}, wave_bri_{0}, wave_kel_{2700};
-	uint8_t _sequence = 0;
-	unsigned long lastChange = millis();
-	uint32_t tx_bytes = 0;
-	uint32_t rx_bytes = 0;
-
-	byte site_mac[6] = {0x4C, 0x49, 0x46, 0x58, 0x56, 0x32}; // spells out "LIFXV2"
-
-	// tags for this bulb, seemingly unused on current real bulbs
-	char bulbTags[LifxBulbTagsLength] = {
-		0, 0, 0, 0, 0, 0, 0, 0};
-	char bulbTagLabels[LifxBulbTagLabelsLength] = "";
-
-	// real guids are stored as byte arrays instead of a char string representation
-	byte bulbGroupGUIDb[16] = {};
-	byte bulbLocationGUIDb[16] = {};
-	// Guids in packets come in a bizarre mix of big and little endian
-	uint8_t guidSeq[16] = {3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15};
-
-	AsyncUDP Udp;
+	unsigned long lastChange = ::millis();
+	unsigned long last_stats_log_{0};
+
+	// One socket for every instance, bound by the first one to start
+	static AsyncUDP *shared_udp_;
+	static LifxDeviceSet shared_devices_;
 
 	// ---- Persistence ----
 	ESPPreferenceObject pref_;
 	uint32_t yaml_hash_{0};
 	uint32_t compute_yaml_hash_();
-	void save_state_();
 
 	// ---- Method declarations (implemented in lifx_emulation.cpp) ----
 	void beginUDP();
-	void incomingUDP(AsyncUDPPacket &packet);
-	void processRequest(byte *packetBuffer, uint32_t packetSize, LifxPacket &request);
-	void handleRequest(LifxPacket &request, AsyncUDPPacket &packet);
-	unsigned int sendPacket(LifxPacket &pkt, AsyncUDPPacket &Udpi);
-	void buildLightStateData(byte *out);
-	void setLight();
-	void setLightCombined();
-	void setLightDual();
-	void startWaveform();
-	void stopWaveform(bool restore);
+	static void incomingUDP(AsyncUDPPacket &packet);
+	void setLightCombined(const LifxLightCommand &cmd);
+	void setLightDual(const LifxLightCommand &cmd);
+	void setColorPrecise(light::LightCall &call, const LifxLightCommand &cmd);
+	void setWhitePrecise(light::LightCall &call, uint16_t kel);
+	void renderZones();
+	void renderTile(light::AddressableLight *strip);
 };
 
 } // namespace lifx_emulation
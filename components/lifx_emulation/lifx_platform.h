@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Thin platform seams between the portable LIFX protocol core (LifxDevice)
+// and whatever is hosting it. On the ESP the LifxEmulation component
+// implements all of these on top of AsyncUDP, WiFi, light::LightState,
+// time::RealTimeClock and ESPPreferences. The host build (see CMakeLists.txt
+// at the repo root) implements them with plain C++ so the decode/dispatch/
+// encode path can be benchmarked off-device.
+
+#ifdef LIFX_HOST_BUILD
+#include <cstdarg>
+#include <cstdio>
+
+namespace esphome {
+namespace lifx_emulation {
+// Host builds only print log lines when verbose output was requested
+extern int lifx_host_log_level;
+inline void lifx_host_log(int level, char lvl, const char *tag, const char *fmt, ...)
+{
+	if (level > lifx_host_log_level)
+		return;
+	va_list args;
+	va_start(args, fmt);
+	fprintf(stderr, "[%c][%s] ", lvl, tag);
+	vfprintf(stderr, fmt, args);
+	fputc('\n', stderr);
+	va_end(args);
+}
+} // namespace lifx_emulation
+} // namespace esphome
+
+#define ESP_LOGE(tag, ...) lifx_host_log(1, 'E', tag, __VA_ARGS__)
+#define ESP_LOGW(tag, ...) lifx_host_log(2, 'W', tag, __VA_ARGS__)
+#define ESP_LOGI(tag, ...) lifx_host_log(3, 'I', tag, __VA_ARGS__)
+#define ESP_LOGD(tag, ...) lifx_host_log(4, 'D', tag, __VA_ARGS__)
+#else
+#include "esphome/core/log.h"
+#endif
+
+struct LifxHSBK;
+
+namespace esphome {
+namespace lifx_emulation {
+
+struct LifxPersistentState;
+
+// Remote endpoint a request came from; responses are addressed back to it.
+// The address is stored in network byte order as lwIP/IPAddress do.
+struct LifxPeer {
+	uint32_t ip;
+	uint16_t port;
+};
+
+// Desired light output as computed by the protocol core
+struct LifxLightCommand {
+	uint16_t hue;
+	uint16_t sat;
+	uint16_t bri;
+	uint16_t kel;
+	uint16_t power;
+	uint32_t duration; // transition time in milliseconds
+};
+
+class LifxTransport {
+public:
+	virtual void send(const LifxPeer &peer, const uint8_t *data, size_t len) = 0;
+	// Signal strength in mW, as reported by StateWifiInfo
+	virtual float signal_mw() = 0;
+
+protected:
+	~LifxTransport() = default;
+};
+
+class LifxLightOutput {
+public:
+	virtual void apply(const LifxLightCommand &cmd) = 0;
+
+protected:
+	~LifxLightOutput() = default;
+};
+
+// Per-zone output used instead of LifxLightOutput when zones or a tile are configured
+class LifxZoneOutput {
+public:
+	// zones[0..count) in strip order, or tile pixels row by row; power/duration
+	// as in LifxLightCommand
+	virtual void apply_zones(const LifxHSBK *zones, uint16_t count, uint16_t power, uint32_t duration) = 0;
+
+protected:
+	~LifxZoneOutput() = default;
+};
+
+class LifxClock {
+public:
+	virtual uint32_t millis() = 0;
+	// Only used to time the hot path (lifx_stats.h); wraps after ~71 minutes
+	virtual uint32_t micros() { return millis() * 1000; }
+	// Wall clock in seconds since the unix epoch
+	virtual uint64_t utc_seconds() = 0;
+
+protected:
+	~LifxClock() = default;
+};
+
+class LifxStorage {
+public:
+	virtual void save(const LifxPersistentState &state) = 0;
+
+protected:
+	~LifxStorage() = default;
+};
+
+} // namespace lifx_emulation
+} // namespace esphome
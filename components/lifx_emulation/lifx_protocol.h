@@ -24,30 +24,22 @@
 //     [32-33] type        uint16 LE - message type
 //     [34-35] reserved    uint16
 //
-// This struct is NOT a wire-format overlay; fields are populated via
-// manual deserialization in processRequest().
+// Response under construction. Handlers fill in the per-response header
+// fields and write the payload through `data`, which points directly into
+// one of the device's transmit buffers (the header template sits right
+// before it); sendPacket() patches these fields into that template.
+// Incoming requests are read in place through LifxPacketView instead.
 struct LifxPacket
 {
-	// Frame
-	uint16_t size;       // total message size (LE)
-	uint16_t protocol;   // protocol(1024) | addressable | tagged | origin
-	byte source[4];      // client source identifier
-
-	// Frame Address
-	byte bulbAddress[6]; // target device MAC
-	uint16_t reserved2;  // reserved
-	byte site[6];        // reserved
-
-	uint8_t res_ack;     // bit 0: res_required, bit 1: ack_required
-	uint8_t sequence;    // message sequence number
-
-	// Protocol Header
-	uint64_t timestamp;  // reserved
-	uint16_t packet_type; // message type (LE)
-	uint16_t reserved4;
+	uint16_t protocol;    // protocol(1024) | addressable | tagged | origin
+	byte source[4];       // client source identifier (echoed from request)
+	uint8_t res_ack;      // bit 0: res_required, bit 1: ack_required
+	uint8_t sequence;     // message sequence number (echoed from request)
+	uint16_t packet_type; // message type
+	uint64_t timestamp;   // response time, see LifxDevice::lifx_timestamp_()
 
 	// Payload (not part of wire header)
-	byte data[128];
+	byte *data;
 	int data_size;
 };
 
@@ -56,20 +48,30 @@ struct LifxPacket
 const unsigned int LifxProtocol_AllBulbsResponse = 21504; // 0x5400 - origin=1, tagged=0
 const unsigned int LifxProtocol_AllBulbsRequest = 13312;  // 0x3400 - origin=0, tagged=1
 const unsigned int LifxProtocol_BulbCommand = 5120;       // 0x1400 - origin=0, tagged=0
+const uint16_t LifxProtocol_Tagged = 0x2000;              // bit 13 - frame is for all bulbs
 
 const unsigned int LifxPacketSize = 36;
 const unsigned int LifxPort = 56700; // local port to listen on
 const unsigned int LifxBulbLabelLength = 32;
 const unsigned int LifxBulbTagsLength = 8;
 const unsigned int LifxBulbTagLabelsLength = 32;
-#define LIFX_MAX_PACKET_LENGTH 512
+#define LIFX_MAX_PACKET_LENGTH 700        // header + SetExtendedColorZones, the largest request
+#define LIFX_MAX_RESPONSE_PAYLOAD 882      // StateDeviceChain (882) is the largest we send
+#define LIFX_MAX_FAST_RESPONSE_PAYLOAD 128 // responses built in the UDP callback
+#define LIFX_MAX_ZONES 255                 // zone indices are uint8 in SetColorZones/StateMultiZone
+#define LIFX_MAX_TILE_SIDE 16              // tile width/height limit (a LIFX Tile is 8x8)
+#define LIFX_MAX_TILE_FRAMEBUFFERS 8       // fb_index 0 is shown, the rest are back buffers
 
 // Firmware versions, etc
 const byte LifxBulbVendor = 1;
 const byte LifxBulbProduct = 22;
+const byte LifxBulbProductMultiZone = 32; // LIFX Z, reported when zones are configured
+const byte LifxBulbProductTile = 55;      // LIFX Tile, reported when a tile is configured
 const byte LifxBulbVersion = 0;
 const byte LifxFirmwareVersionMajor = 1;
 const byte LifxFirmwareVersionMinor = 5;
+const byte LifxTileFirmwareMajor = 3;     // host firmware reported in tile mode
+const byte LifxTileFirmwareMinor = 70;
 const unsigned int LifxMagicNum = 614500;
 
 // Service types (StateService payload)
@@ -242,6 +244,13 @@ const uint16_t GET_RPOWER = 816;               // GetRPower(816)
 const uint16_t SET_RPOWER = 817;               // SetRPower(817)
 const uint16_t STATE_RPOWER = 818;             // StateRPower(818)
 
+// ============================================================================
+// Emulator extensions (not LIFX messages; real bulbs ignore them)
+// ============================================================================
+
+const uint16_t GET_TRACE = 0xFF00;             // dump the packet trace ring (lifx_trace.h)
+const uint16_t STATE_TRACE = 0xFF01;           // one chunk of trace records
+
 // ============================================================================
 // Enumerations
 // https://lan.developer.lifx.com/docs/waveforms
@@ -273,6 +282,12 @@ enum LifxTileEffectType : uint8_t {
 	TILE_EFFECT_SKY     = 5,
 };
 
+enum LifxTileEffectSkyType : uint8_t {
+	TILE_SKY_SUNRISE = 0,
+	TILE_SKY_SUNSET  = 1,
+	TILE_SKY_CLOUDS  = 2,
+};
+
 enum LifxLastHevResult : uint8_t {
 	HEV_SUCCESS            = 0,
 	HEV_BUSY               = 1,
@@ -285,8 +300,9 @@ enum LifxLastHevResult : uint8_t {
 
 // ============================================================================
 // Payload Structures (packed, little-endian)
-// These can be used for documentation or direct buffer interpretation.
-// The current codebase uses manual byte-level access into LifxPacket.data[].
+// Overlaid directly on received datagrams via LifxPacketView::payload_as<>().
+// Fields are read in place, which assumes a little-endian host (ESP8266,
+// ESP32 and x86 all are).
 // ============================================================================
 
 // HSBK color structure (8 bytes) - used in many payloads
@@ -504,7 +520,12 @@ struct __attribute__((packed)) LifxPayloadMultiZoneEffect {
 	uint64_t duration;   // nanoseconds
 	uint32_t reserved7;
 	uint32_t reserved8;
-	byte parameters[32];
+	byte parameters[32]; // MOVE: uint32 at [4] is the direction, see below
+};
+
+enum LifxMultiZoneEffectDirection : uint32_t {
+	MULTIZONE_MOVE_TOWARDS_END   = 0, // colors travel to higher zone indexes
+	MULTIZONE_MOVE_TOWARDS_START = 1, // colors travel to zone 0
 };
 
 // SetExtendedColorZones(510) payload
@@ -523,6 +544,7 @@ struct __attribute__((packed)) LifxPayloadStateExtColorZones {
 	uint8_t colors_count;
 	LifxHSBK colors[82];
 };
+static_assert(sizeof(LifxPayloadStateExtColorZones) <= LIFX_MAX_RESPONSE_PAYLOAD, "raise LIFX_MAX_RESPONSE_PAYLOAD");
 
 // --- Relay Message Payloads (LIFX Switch) ---
 
@@ -542,6 +564,45 @@ struct __attribute__((packed)) LifxPayloadSetUserPosition {
 	float user_y;
 };
 
+// One entry of StateDeviceChain
+struct __attribute__((packed)) LifxTileDevice {
+	int16_t accel_meas_x;
+	int16_t accel_meas_y;
+	int16_t accel_meas_z;
+	int16_t reserved;
+	float user_x;
+	float user_y;
+	uint8_t width;
+	uint8_t height;
+	uint8_t reserved2;
+	uint32_t device_version_vendor;
+	uint32_t device_version_product;
+	uint32_t reserved3;
+	uint64_t firmware_build;
+	uint64_t reserved4;
+	uint16_t firmware_version_minor;
+	uint16_t firmware_version_major;
+	uint32_t reserved5;
+};
+
+// StateDeviceChain(702) payload
+struct __attribute__((packed)) LifxPayloadStateDeviceChain {
+	uint8_t start_index;
+	LifxTileDevice tile_devices[16];
+	uint8_t tile_devices_count;
+};
+static_assert(sizeof(LifxPayloadStateDeviceChain) <= LIFX_MAX_RESPONSE_PAYLOAD, "raise LIFX_MAX_RESPONSE_PAYLOAD");
+
+// Get64(707) payload
+struct __attribute__((packed)) LifxPayloadGet64 {
+	uint8_t tile_index;
+	uint8_t length;
+	uint8_t reserved;
+	uint8_t x;
+	uint8_t y;
+	uint8_t width;
+};
+
 // Set64(715) payload
 struct __attribute__((packed)) LifxPayloadSet64 {
 	uint8_t tile_index;
@@ -564,6 +625,104 @@ struct __attribute__((packed)) LifxPayloadState64 {
 	LifxHSBK colors[64];
 };
 
+// CopyFrameBuffer(716) payload
+struct __attribute__((packed)) LifxPayloadCopyFrameBuffer {
+	uint8_t tile_index;
+	uint8_t length;
+	uint8_t src_fb_index;
+	uint8_t dst_fb_index;
+	uint8_t src_x;
+	uint8_t src_y;
+	uint8_t dst_x;
+	uint8_t dst_y;
+	uint8_t width;
+	uint8_t height;
+	uint32_t duration;
+};
+
+// Effect settings shared by SetTileEffect(719) and StateTileEffect(720)
+struct __attribute__((packed)) LifxTileEffectSettings {
+	uint32_t instanceid;
+	uint8_t type;                  // LifxTileEffectType enum
+	uint32_t speed;                // milliseconds
+	uint64_t duration;             // nanoseconds, 0 = until replaced
+	uint32_t reserved6;
+	uint32_t reserved7;
+	uint8_t sky_type;              // LifxTileEffectSkyType, SKY only
+	uint8_t reserved8[3];
+	uint8_t cloud_saturation_min;  // SKY clouds only
+	uint8_t reserved9[3];
+	uint8_t cloud_saturation_max;
+	uint8_t reserved10[23];
+	uint8_t palette_count;
+	LifxHSBK palette[16];
+};
+
+// SetTileEffect(719) payload
+struct __attribute__((packed)) LifxPayloadSetTileEffect {
+	uint8_t reserved0;
+	uint8_t reserved1;
+	LifxTileEffectSettings settings;
+};
+
+// StateTileEffect(720) payload
+struct __attribute__((packed)) LifxPayloadStateTileEffect {
+	uint8_t reserved0;
+	LifxTileEffectSettings settings;
+};
+
+static_assert(LifxPacketSize + sizeof(LifxPayloadSetExtColorZones) <= LIFX_MAX_PACKET_LENGTH, "raise LIFX_MAX_PACKET_LENGTH");
+static_assert(LifxPacketSize + sizeof(LifxPayloadSet64) <= LIFX_MAX_PACKET_LENGTH, "raise LIFX_MAX_PACKET_LENGTH");
+
+// ============================================================================
+// Wire header overlay and read-only request view
+// ============================================================================
+
+// Wire-format header (36 bytes), see the layout at the top of this file
+struct __attribute__((packed)) LifxWireHeader {
+	uint16_t size;
+	uint16_t protocol;
+	byte source[4];
+	byte target[6];
+	byte reserved2[8];
+	uint8_t res_ack;
+	uint8_t sequence;
+	uint64_t timestamp;  // reserved in requests; responses carry the current time
+	uint16_t type;
+	uint16_t reserved4;
+};
+static_assert(sizeof(LifxWireHeader) == LifxPacketSize, "LIFX header must be 36 bytes");
+
+// Zero-copy view over a received datagram. The caller guarantees the buffer
+// holds at least a full header and outlives the view. Payload accessors are
+// bounds-checked against the datagram length: payload_as<T>() returns nullptr
+// when the payload is too short to contain a T.
+class LifxPacketView
+{
+public:
+	LifxPacketView(const uint8_t *data, uint32_t len) : data_(data), len_(len) {}
+
+	const LifxWireHeader &header() const { return *reinterpret_cast<const LifxWireHeader *>(data_); }
+	uint16_t type() const { return header().type; }
+	uint16_t protocol() const { return header().protocol; }
+	uint8_t res_ack() const { return header().res_ack; }
+	uint8_t sequence() const { return header().sequence; }
+	const byte *source() const { return header().source; }
+	const byte *target() const { return header().target; }
+
+	const uint8_t *payload() const { return data_ + LifxPacketSize; }
+	uint32_t payload_size() const { return len_ - LifxPacketSize; }
+
+	template<typename T> const T *payload_as() const
+	{
+		return payload_size() >= sizeof(T) ? reinterpret_cast<const T *>(payload()) : nullptr;
+	}
+
+private:
+	const uint8_t *data_;
+	uint32_t len_;
+};
+
 // ============================================================================
 // Packet type name lookup (for debug logging)
 // ============================================================================
@@ -669,6 +828,9 @@ inline const char *lifx_packet_type_name(uint16_t type) {
 	case GET_RPOWER: return "GetRPower";
 	case SET_RPOWER: return "SetRPower";
 	case STATE_RPOWER: return "StateRPower";
+	// Emulator extensions
+	case GET_TRACE: return "GetTrace";
+	case STATE_TRACE: return "StateTrace";
 	default: return "Unknown";
 	}
 }
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <atomic>
+#include <cstring>
+
+#include "lifx_platform.h"
+#include "lifx_protocol.h"
+
+namespace esphome {
+namespace lifx_emulation {
+
+// Arena bytes reserved per configured queue entry. Most requests are well
+// under this (SetColor is 49 bytes); a full SetExtendedColorZones frame
+// simply uses several entries' worth of space.
+#define LIFX_QUEUE_BYTES_PER_FRAME 128
+
+// Header of one received datagram in the arena; the frame bytes follow it
+struct LifxQueuedFrame {
+	uint32_t len;
+	LifxPeer peer;
+	uint8_t device; // index in the LifxDeviceSet the frame is queued for
+	const uint8_t *data() const { return reinterpret_cast<const uint8_t *>(this + 1); }
+};
+
+// Lock-free single-producer/single-consumer ring of raw frames. The UDP
+// callback (lwIP/async task on ESP32) pushes, ESPHome's loop() pops. Only
+// plain atomic loads and stores are used, so no libatomic support is needed
+// on the ESP8266.
+//
+// Frames are stored back to back in one byte arena, so a 700 byte
+// SetExtendedColorZones costs 700 bytes and a 49 byte SetColor costs 49,
+// instead of every slot being sized for the largest message. A record that
+// does not fit before the end of the arena is preceded by a wrap marker and
+// written at the start.
+class LifxFrameQueue
+{
+public:
+	~LifxFrameQueue() { delete[] arena_; }
+
+	// Allocates the arena; 0 disables queueing. Call before use. Twice the
+	// largest record guarantees a maximum size frame fits into an empty queue
+	// whichever side of the current position has more room.
+	void init(size_t bytes)
+	{
+		delete[] arena_;
+		arena_ = nullptr;
+		size_ = 0;
+		if (bytes == 0)
+			return;
+		size_t min_bytes = 2 * record_size_(LIFX_MAX_PACKET_LENGTH) + ALIGN;
+		size_ = align_(bytes < min_bytes ? min_bytes : bytes);
+		arena_ = new uint8_t[size_];
+	}
+	bool enabled() const { return size_ != 0; }
+
+	// Producer side
+	bool empty() const
+	{
+		return head_.load(std::memory_order_relaxed) == tail_.load(std::memory_order_acquire);
+	}
+	bool push(const uint8_t *data, uint32_t len, const LifxPeer &peer, uint8_t device)
+	{
+		size_t need = record_size_(len);
+		size_t head = head_.load(std::memory_order_relaxed);
+		size_t tail = tail_.load(std::memory_order_acquire);
+		size_t at;
+		// head == tail means empty, so head may never catch up with tail
+		if (head >= tail)
+		{
+			if (size_ - head > need || (size_ - head == need && tail != 0))
+			{
+				at = head;
+			}
+			else if (tail > need)
+			{
+				write_len_(head, WRAP);
+				at = 0;
+			}
+			else
+			{
+				return false;
+			}
+		}
+		else if (tail - head > need)
+		{
+			at = head;
+		}
+		else
+		{
+			return false;
+		}
+
+		LifxQueuedFrame *frame = reinterpret_cast<LifxQueuedFrame *>(arena_ + at);
+		frame->len = len;
+		frame->peer = peer;
+		frame->device = device;
+		memcpy(arena_ + at + sizeof(LifxQueuedFrame), data, len);
+		at += need;
+		head_.store(at == size_ ? 0 : at, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer side: oldest frame or nullptr, release it with pop()
+	const LifxQueuedFrame *front()
+	{
+		size_t tail = tail_.load(std::memory_order_relaxed);
+		if (tail == head_.load(std::memory_order_acquire))
+			return nullptr;
+		if (read_len_(tail) == WRAP)
+		{
+			// The producer only writes a wrap marker together with a record at 0
+			tail = 0;
+			tail_.store(0, std::memory_order_release);
+		}
+		return reinterpret_cast<const LifxQueuedFrame *>(arena_ + tail);
+	}
+	void pop()
+	{
+		size_t tail = tail_.load(std::memory_order_relaxed);
+		tail += record_size_(read_len_(tail));
+		tail_.store(tail == size_ ? 0 : tail, std::memory_order_release);
+	}
+
+private:
+	static const size_t ALIGN = 4; // records start 4-byte aligned, so a wrap marker always fits
+	static const uint32_t WRAP = 0xFFFFFFFF;
+
+	static size_t align_(size_t n) { return (n + ALIGN - 1) & ~(ALIGN - 1); }
+	static size_t record_size_(size_t len) { return align_(sizeof(LifxQueuedFrame) + len); }
+	uint32_t read_len_(size_t at) const
+	{
+		uint32_t len;
+		memcpy(&len, arena_ + at, sizeof(len));
+		return len;
+	}
+	void write_len_(size_t at, uint32_t len) { memcpy(arena_ + at, &len, sizeof(len)); }
+
+	uint8_t *arena_{nullptr};
+	size_t size_{0};
+	std::atomic<size_t> head_{0};
+	std::atomic<size_t> tail_{0};
+};
+
+} // namespace lifx_emulation
+} // namespace esphome
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "lifx_platform.h"
+
+namespace esphome {
+namespace lifx_emulation {
+
+// Always-on hot path timing. Each stage keeps a histogram of microsecond
+// latencies in power-of-two buckets: bucket 0 is 0 us, bucket i holds
+// [2^(i-1), 2^i) us and the last one everything from ~0.5 s up. Recording
+// is one count-leading-zeros and an increment. Sends happen on both the UDP
+// task and the main loop, but like LifxFrameQueue this sticks to plain
+// atomic loads and stores (no libatomic on the ESP8266), so two sends racing
+// on separate cores can rarely lose a count.
+#define LIFX_LATENCY_BUCKETS 20
+
+enum LifxLatencyStage : uint8_t {
+	LATENCY_RECEIVE,  // handle_datagram(): filter, then fast answer or queue copy
+	LATENCY_DISPATCH, // handleRequest(): decode, apply and respond
+	LATENCY_LIGHT,    // light or zone output apply (ESPHome call.perform())
+	LATENCY_SAVE,     // flash write
+	LATENCY_SEND,     // one transport send
+	LATENCY_STAGES,
+};
+
+// Received message families, counted for packets/sec
+enum LifxPacketFamily : uint8_t {
+	FAMILY_DEVICE,
+	FAMILY_LIGHT,
+	FAMILY_MULTIZONE,
+	FAMILY_TILE,
+	FAMILY_OTHER,
+	PACKET_FAMILIES,
+};
+
+inline LifxPacketFamily lifx_packet_family(uint16_t type)
+{
+	if (type < 100)
+		return FAMILY_DEVICE;
+	if (type < 200)
+		return FAMILY_LIGHT;
+	if (type >= 500 && type < 600)
+		return FAMILY_MULTIZONE;
+	if (type >= 700 && type < 800)
+		return FAMILY_TILE;
+	return FAMILY_OTHER;
+}
+
+struct LifxLatencyHistogram {
+	std::atomic<uint32_t> buckets[LIFX_LATENCY_BUCKETS] = {};
+
+	void record(uint32_t us)
+	{
+		uint8_t index = us ? 32 - __builtin_clz(us) : 0;
+		if (index >= LIFX_LATENCY_BUCKETS)
+			index = LIFX_LATENCY_BUCKETS - 1;
+		buckets[index].store(buckets[index].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+	void read(uint32_t *out) const
+	{
+		for (int i = 0; i < LIFX_LATENCY_BUCKETS; i++)
+			out[i] = buckets[i].load(std::memory_order_relaxed);
+	}
+};
+
+// Upper bound in us of the bucket holding the given percentile of counts;
+// 0 when nothing was recorded
+inline uint32_t lifx_latency_percentile(const uint32_t *counts, uint8_t percent)
+{
+	uint32_t total = 0;
+	for (int i = 0; i < LIFX_LATENCY_BUCKETS; i++)
+		total += counts[i];
+	if (!total)
+		return 0;
+	uint32_t rank = (uint32_t)(((uint64_t) total * percent + 99) / 100);
+	uint32_t seen = 0;
+	for (int i = 0; i < LIFX_LATENCY_BUCKETS; i++)
+	{
+		seen += counts[i];
+		if (seen >= rank)
+			return i ? (1u << i) - 1 : 0;
+	}
+	return (1u << (LIFX_LATENCY_BUCKETS - 1)) - 1;
+}
+
+// Times the enclosing block into a histogram
+class LifxLatencyScope
+{
+public:
+	LifxLatencyScope(LifxLatencyHistogram &histogram, LifxClock *clock)
+		: histogram_(histogram), clock_(clock), start_(clock->micros()) {}
+	~LifxLatencyScope() { histogram_.record(clock_->micros() - start_); }
+
+private:
+	LifxLatencyHistogram &histogram_;
+	LifxClock *clock_;
+	uint32_t start_;
+};
+
+} // namespace lifx_emulation
+} // namespace esphome
@@ -0,0 +1,143 @@
+#include "lifx_tile_effect.h"
+#include "lifx_color.h"
+
+namespace esphome {
+namespace lifx_emulation {
+
+// Pseudo random 16-bit value for an integer lattice point
+static inline uint16_t lattice(int32_t x, int32_t y, int32_t z)
+{
+	uint32_t h = (uint32_t) x * 0x8da6b343u ^ (uint32_t) y * 0xd8163841u ^ (uint32_t) z * 0xcb1ab31fu;
+	h ^= h >> 15;
+	h *= 0x2c1b3c6du;
+	h ^= h >> 12;
+	return (uint16_t)(h >> 16);
+}
+
+// 3f^2 - 2f^3 for f in 0..65535, so cells join without visible creases
+static inline uint32_t smooth(uint32_t f)
+{
+	uint32_t f2 = (f * f) >> 16;
+	return (f2 * ((3 * 65536 - 2 * f) >> 2)) >> 14;
+}
+
+uint16_t lifx_noise3(int32_t x, int32_t y, int32_t z)
+{
+	int32_t xi = x >> 16, yi = y >> 16, zi = z >> 16;
+	uint32_t u = smooth(x & 0xffff), v = smooth(y & 0xffff), w = smooth(z & 0xffff);
+
+	uint16_t near = lifx_lerp16(
+		lifx_lerp16(lattice(xi, yi, zi), lattice(xi + 1, yi, zi), u),
+		lifx_lerp16(lattice(xi, yi + 1, zi), lattice(xi + 1, yi + 1, zi), u), v);
+	uint16_t far = lifx_lerp16(
+		lifx_lerp16(lattice(xi, yi, zi + 1), lattice(xi + 1, yi, zi + 1), u),
+		lifx_lerp16(lattice(xi, yi + 1, zi + 1), lattice(xi + 1, yi + 1, zi + 1), u), v);
+	return lifx_lerp16(near, far, w);
+}
+
+static const LifxHSBK DEFAULT_PALETTE[] = {
+	{0, 65535, 65535, 3500},     {9362, 65535, 65535, 3500},  {18724, 65535, 65535, 3500},
+	{28086, 65535, 65535, 3500}, {37449, 65535, 65535, 3500}, {46811, 65535, 65535, 3500},
+	{56173, 65535, 65535, 3500},
+};
+
+// Position 0-65535 around a cyclic palette, blending neighbouring entries
+static LifxHSBK palette_at(const LifxHSBK *palette, uint8_t count, uint16_t position)
+{
+	uint32_t scaled = (uint32_t) position * count;
+	uint8_t index = scaled >> 16;
+	const LifxHSBK &a = palette[index];
+	const LifxHSBK &b = palette[index + 1 == count ? 0 : index + 1];
+	uint32_t t = scaled & 0xffff;
+	return {lifx_lerp_hue16(a.hue, b.hue, t), lifx_lerp16(a.saturation, b.saturation, t),
+		lifx_lerp16(a.brightness, b.brightness, t), lifx_lerp16(a.kelvin, b.kelvin, t)};
+}
+
+void lifx_tile_morph(LifxHSBK *out, uint8_t width, uint8_t height, uint32_t time,
+	const LifxHSBK *palette, uint8_t palette_count)
+{
+	if (palette_count == 0)
+	{
+		palette = DEFAULT_PALETTE;
+		palette_count = sizeof(DEFAULT_PALETTE) / sizeof(DEFAULT_PALETTE[0]);
+	}
+	// Blobs about four pixels across, slowly drifting sideways
+	const int32_t step = 65536 / 4;
+	int32_t drift = time >> 2;
+	for (uint8_t y = 0; y < height; y++)
+	{
+		for (uint8_t x = 0; x < width; x++)
+		{
+			uint16_t n = lifx_noise3(x * step + drift, y * step, time);
+			// Value noise rarely reaches its ends, so go round the palette twice
+			*out++ = palette_at(palette, palette_count, (uint16_t)(n * 2));
+		}
+	}
+}
+
+void lifx_tile_flame(LifxHSBK *out, uint8_t width, uint8_t height, uint32_t time, uint16_t brightness)
+{
+	const int32_t step = 65536 / 3;
+	for (uint8_t y = 0; y < height; y++)
+	{
+		// Hottest at the bottom row, fading out towards the top
+		uint32_t fuel = (uint32_t)(y + 1) * 65536 / height;
+		for (uint8_t x = 0; x < width; x++)
+		{
+			// The pattern scrolls up two cells per time unit and churns as it goes
+			uint16_t n = lifx_noise3(x * step, y * step + (int32_t)(time * 2), time >> 1);
+			uint32_t heat = (n * fuel) >> 15;
+			if (heat > 65535)
+				heat = 65535;
+			// Red when cool to yellow (60 degrees) when hot
+			*out++ = {(uint16_t)((heat * 10923) >> 16), 65535, (uint16_t)((brightness * heat) >> 16), 3500};
+		}
+	}
+}
+
+void lifx_tile_clouds(LifxHSBK *out, uint8_t width, uint8_t height, uint32_t time, uint16_t brightness,
+	uint8_t saturation_min, uint8_t saturation_max)
+{
+	const uint16_t SKY_HUE = 36408; // 200 degrees
+	const int32_t step_x = 65536 / 5, step_y = 65536 / 4;
+	uint16_t clear = saturation_max * 257, cloudy = saturation_min * 257;
+	for (uint8_t y = 0; y < height; y++)
+	{
+		for (uint8_t x = 0; x < width; x++)
+		{
+			// One cell per time unit across, reshaping slowly
+			uint16_t n = lifx_noise3(x * step_x + (int32_t) time, y * step_y, time >> 2);
+			uint32_t cloud = n <= 28672 ? 0 : (uint32_t)(n - 28672) * 3;
+			if (cloud > 65535)
+				cloud = 65535;
+			*out++ = {SKY_HUE, lifx_lerp16(clear, cloudy, cloud), brightness, 6500};
+		}
+	}
+}
+
+void lifx_tile_sun(LifxHSBK *out, uint8_t width, uint8_t height, uint16_t level, uint16_t brightness)
+{
+	// Distances in 1/256 pixel, normalised by the longer side
+	uint32_t span = (uint32_t)(width > height ? width : height) * 256;
+	uint16_t saturation = (uint16_t)(65535 - ((((uint32_t) level * level) >> 16) * 3 >> 2));
+	uint16_t kelvin = (uint16_t)(2000 + ((level * 3500u) >> 16));
+	for (uint8_t y = 0; y < height; y++)
+	{
+		uint32_t dy = (uint32_t)(height - 1 - y) * 256;
+		for (uint8_t x = 0; x < width; x++)
+		{
+			int32_t dx2 = 2 * x - (width - 1);
+			uint32_t dx = (uint32_t)(dx2 < 0 ? -dx2 : dx2) * 128;
+			// Octagonal approximation of the euclidean distance
+			uint32_t distance = dx > dy ? dx + dy / 2 : dy + dx / 2;
+			uint32_t glow = distance >= span ? 0 : 65535 - distance * 65535 / span;
+			// The whole sky follows the level, brighter around the sun
+			uint32_t intensity = (level * (32768 + (glow >> 1))) >> 16;
+			*out++ = {(uint16_t)((intensity * 9000) >> 16), saturation,
+				(uint16_t)((brightness * intensity) >> 16), kelvin};
+		}
+	}
+}
+
+} // namespace lifx_emulation
+} // namespace esphome
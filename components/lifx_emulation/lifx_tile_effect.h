@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+
+#include "lifx_protocol.h"
+
+namespace esphome {
+namespace lifx_emulation {
+
+// Procedural tile effects (SetTileEffect) rendered on the device into a
+// row major width x height frame. Everything is integer math with a fixed
+// cost per pixel (at most eight lattice hashes), so a 16x16 frame takes the
+// same time every frame whatever the effect state.
+//
+// time is the effect clock in 16.16 fixed point: one unit per `speed` ms.
+
+// Smooth 3D value noise, 0-65535, at 16.16 fixed point coordinates
+uint16_t lifx_noise3(int32_t x, int32_t y, int32_t z);
+
+// Blobs of palette colors drifting into each other; an empty palette uses a
+// built-in rainbow
+void lifx_tile_morph(LifxHSBK *out, uint8_t width, uint8_t height, uint32_t time,
+	const LifxHSBK *palette, uint8_t palette_count);
+
+// Flames rising from the bottom row, red to yellow, scaled by brightness
+void lifx_tile_flame(LifxHSBK *out, uint8_t width, uint8_t height, uint32_t time, uint16_t brightness);
+
+// Blue sky with clouds drifting across; clear sky at saturation_max and
+// thick cloud at saturation_min (0-255 as in SetTileEffect)
+void lifx_tile_clouds(LifxHSBK *out, uint8_t width, uint8_t height, uint32_t time, uint16_t brightness,
+	uint8_t saturation_min, uint8_t saturation_max);
+
+// Sun glow from the bottom centre; level 0 is night and 65535 daylight
+// (SUNRISE ramps it up over the effect, SUNSET down)
+void lifx_tile_sun(LifxHSBK *out, uint8_t width, uint8_t height, uint16_t level, uint16_t brightness);
+
+} // namespace lifx_emulation
+} // namespace esphome
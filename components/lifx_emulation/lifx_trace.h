@@ -0,0 +1,110 @@
+#pragma once
+
+#include <atomic>
+#include <cstring>
+
+#include "lifx_protocol.h"
+
+namespace esphome {
+namespace lifx_emulation {
+
+// Binary packet trace kept in RAM instead of per-packet debug log lines.
+// Recording copies a few header fields into a fixed slot: no formatting, no
+// allocation, no type name lookup. The ring is dumped on demand over the log
+// (LifxDevice::dump_trace()) or with a GetTrace request, and turned into a
+// readable timeline or pcap by host/lifx_trace.py.
+
+enum LifxTraceEvent : uint8_t {
+	TRACE_FAST = 1,     // answered in the UDP callback from the snapshot
+	TRACE_QUEUED = 2,   // copied into the rx queue for loop()
+	TRACE_DROPPED = 3,  // rx queue full (or oversized frame)
+	TRACE_INLINE = 4,   // handled inside the UDP callback (no rx queue)
+	TRACE_DISPATCH = 5, // handleRequest() ran
+	TRACE_SENT = 6,     // response or ack sent
+};
+
+// Flag bits next to the event (in the top nibble)
+#define LIFX_TRACE_RES_ACK_MASK 0x03 // res_required / ack_required as received or sent
+#define LIFX_TRACE_TAGGED 0x04
+
+struct __attribute__((packed)) LifxTraceRecord {
+	uint32_t time_us;    // clock micros() when the event started
+	uint32_t source;     // client source id
+	uint16_t type;
+	uint16_t size;       // whole frame, header included
+	uint16_t handler_us; // time spent, saturating at 65535
+	uint8_t sequence;
+	uint8_t flags;       // LifxTraceEvent << 4 | LIFX_TRACE_* bits
+};
+static_assert(sizeof(LifxTraceRecord) == 16, "trace records are decoded by host/lifx_trace.py");
+
+// Two lanes, one per task, so each has a single producer and, as in
+// LifxFrameQueue, plain atomic loads and stores suffice. Readers may see a
+// record that is being overwritten; this is a debugging aid.
+enum LifxTraceLane : uint8_t {
+	TRACE_LANE_NETWORK, // UDP callback
+	TRACE_LANE_LOOP,    // main loop
+	TRACE_LANES,
+};
+
+class LifxTraceRing
+{
+public:
+	~LifxTraceRing() { delete[] records_; }
+
+	// Records per lane; 0 disables tracing. Call before use.
+	void init(uint16_t records)
+	{
+		delete[] records_;
+		records_ = records ? new LifxTraceRecord[TRACE_LANES * records]() : nullptr;
+		capacity_ = records;
+	}
+	bool enabled() const { return capacity_ != 0; }
+	uint16_t capacity() const { return capacity_; }
+
+	void record(LifxTraceLane lane, LifxTraceEvent event, uint32_t time_us, uint32_t handler_us,
+		const uint8_t *frame, uint32_t len)
+	{
+		const LifxWireHeader &header = *reinterpret_cast<const LifxWireHeader *>(frame);
+		uint32_t n = written_[lane].load(std::memory_order_relaxed);
+		LifxTraceRecord &r = records_[lane * capacity_ + n % capacity_];
+		r.time_us = time_us;
+		memcpy(&r.source, header.source, sizeof(r.source));
+		r.type = header.type;
+		r.size = len > 65535 ? 65535 : len;
+		r.handler_us = handler_us > 65535 ? 65535 : handler_us;
+		r.sequence = header.sequence;
+		r.flags = (event << 4) | (header.res_ack & LIFX_TRACE_RES_ACK_MASK) |
+			((header.protocol & LifxProtocol_Tagged) ? LIFX_TRACE_TAGGED : 0);
+		written_[lane].store(n + 1, std::memory_order_release);
+	}
+
+	// Records ever written to a lane; the last capacity() of them are kept
+	uint32_t written(LifxTraceLane lane) const { return written_[lane].load(std::memory_order_acquire); }
+	uint32_t oldest(LifxTraceLane lane) const
+	{
+		uint32_t n = written(lane);
+		return n > capacity_ ? n - capacity_ : 0;
+	}
+	const LifxTraceRecord &at(LifxTraceLane lane, uint32_t n) const { return records_[lane * capacity_ + n % capacity_]; }
+
+protected:
+	LifxTraceRecord *records_{nullptr};
+	uint16_t capacity_{0};
+	std::atomic<uint32_t> written_[TRACE_LANES] = {};
+};
+
+// StateTrace: consecutive records of one lane, oldest first
+#define LIFX_TRACE_RECORDS_PER_PACKET 54
+struct __attribute__((packed)) LifxPayloadStateTrace {
+	uint8_t lane;
+	uint8_t count;
+	uint16_t capacity; // records per lane
+	uint32_t first;    // number of records[0] within the lane
+	uint32_t written;  // records written to the lane so far
+	LifxTraceRecord records[LIFX_TRACE_RECORDS_PER_PACKET];
+};
+static_assert(sizeof(LifxPayloadStateTrace) <= LIFX_MAX_RESPONSE_PAYLOAD, "raise LIFX_MAX_RESPONSE_PAYLOAD");
+
+} // namespace lifx_emulation
+} // namespace esphome
@@ -6,6 +6,19 @@
 namespace esphome {
 namespace lifx_emulation {
 
+// 32-bit FNV-1a over a byte buffer
+inline uint32_t fnv1a_hash(const void *data, size_t len)
+{
+	const uint8_t *bytes = static_cast<const uint8_t *>(data);
+	uint32_t hash = 2166136261UL;
+	for (size_t i = 0; i < len; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
 inline byte nibble(char c)
 {
 	if (c >= '0' && c <= '9')
@@ -66,6 +79,7 @@ inline void hexCharacterStringToBytes(byte *byteArray, const char *hexString)
 /******************************************************************************
  * HSB to RGB conversion.
  * hue (index): 0-767, sat and bright: 0-255, color[]: output RGB bytes
+ * Scalar reference for lifx_hsbk_to_rgb(), see host/lifx_color_bench.cpp
  *****************************************************************************/
 inline void hsb2rgb(uint16_t index, uint8_t sat, uint8_t bright, uint8_t color[3])
 {
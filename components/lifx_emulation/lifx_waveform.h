@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstdint>
+
+#include "lifx_color.h"
+#include "lifx_protocol.h"
+
+namespace esphome {
+namespace lifx_emulation {
+
+// Waveform shapes in fixed point. A cycle position is a 32-bit phase
+// (0 = start of the cycle, 2^32 = end) and shapes return the share of the
+// target color, 0-65535. Nothing here touches float, which matters on the
+// ESP8266 where every float op is a soft-float call.
+
+// sin(pi * i / 256) for i = 0..256, evaluated at compile time
+struct LifxHalfSineTable {
+	uint16_t values[257];
+
+	constexpr LifxHalfSineTable() : values()
+	{
+		for (int i = 0; i <= 256; i++)
+		{
+			// Taylor series around 0 on the rising half, mirrored for the falling one
+			double x = 3.14159265358979323846 * (i <= 128 ? i : 256 - i) / 256;
+			double term = x, sum = x;
+			for (int n = 1; n < 12; n++)
+			{
+				term *= -x * x / ((2 * n) * (2 * n + 1));
+				sum += term;
+			}
+			values[i] = (uint16_t)(sum * 65535 + 0.5);
+		}
+	}
+};
+
+constexpr LifxHalfSineTable LIFX_HALF_SINE{};
+
+// sin(pi * phase), rising from 0 to 65535 and back over one cycle
+inline uint16_t lifx_half_sine(uint32_t phase)
+{
+	uint32_t index = phase >> 24;
+	return lifx_lerp16(LIFX_HALF_SINE.values[index], LIFX_HALF_SINE.values[index + 1], (phase >> 8) & 0xffff);
+}
+
+// Share of the target color for SAW, SINE, HALF_SINE and TRIANGLE. PULSE
+// depends on the duty cycle in whole milliseconds and is left to the caller.
+inline uint16_t lifx_waveform_shape(uint8_t waveform, uint32_t phase)
+{
+	uint16_t position = phase >> 16;
+	switch (waveform)
+	{
+	case WAVEFORM_SAW:
+		// Linear ramp from original to target, then snap back
+		return position;
+	case WAVEFORM_SINE:
+	{
+		// (1 - cos(2 pi x)) / 2 == sin^2(pi x): original -> target -> original
+		uint32_t s = lifx_half_sine(phase);
+		return (uint16_t)((s * s) >> 16);
+	}
+	case WAVEFORM_HALF_SINE:
+		return lifx_half_sine(phase);
+	case WAVEFORM_TRIANGLE:
+		// Linear original -> target -> original
+		return position < 32768 ? position * 2 : (uint16_t)((65535 - position) * 2);
+	default:
+		return 0;
+	}
+}
+
+// HSBK channels a waveform can drive, as indexes and as bits of a mask
+enum LifxWaveformChannelIndex : uint8_t {
+	WAVEFORM_HUE        = 0,
+	WAVEFORM_SATURATION = 1,
+	WAVEFORM_BRIGHTNESS = 2,
+	WAVEFORM_KELVIN     = 3,
+	WAVEFORM_CHANNELS   = 4,
+};
+const uint8_t WAVEFORM_ALL_CHANNELS = 0x0F;
+
+// One channel of a running waveform. SetWaveform starts all four with the
+// same parameters and SetWaveformOptional only the flagged ones, so effects
+// on different channels run, get replaced and end independently.
+struct LifxWaveformChannel {
+	bool active{false};
+	bool transient{false};   // settle on from instead of to when finished
+	uint8_t waveform{0};     // LifxWaveform enum
+	uint16_t from{0};
+	uint16_t to{0};
+	uint32_t start{0};       // clock ms
+	uint32_t period{0};      // ms per cycle, never 0 while active
+	uint32_t total_ms{0};    // 0 = runs until replaced
+	uint32_t duty_ms{0};     // PULSE high time per cycle
+	uint32_t phase_step{0};  // 32-bit cycle phase per ms
+	uint32_t interval{50};   // frame grid; PULSE frames land on its edges instead
+	uint32_t next{0};        // next frame, ms after start
+
+	// Value at elapsed ms into the effect; hue takes the shortest way round
+	uint16_t sample(uint32_t elapsed, bool is_hue) const
+	{
+		uint32_t in_cycle = elapsed % period;
+		uint16_t f;
+		if (waveform == WAVEFORM_PULSE)
+			// Decided in whole ms so a frame scheduled on an edge lands on the new side
+			f = in_cycle < duty_ms ? 65535 : 0;
+		else
+			f = lifx_waveform_shape(waveform, in_cycle * phase_step);
+		// Stretch to 0..65536 so a full share lands exactly on the target
+		uint32_t t = f + (f >> 15);
+
+		return is_hue ? lifx_lerp_hue16(from, to, t) : lifx_lerp16(from, to, t);
+	}
+
+	// Where the channel rests once the effect is over
+	uint16_t resting() const { return transient ? from : to; }
+};
+
+} // namespace lifx_emulation
+} // namespace esphome
@@ -0,0 +1,22 @@
+#pragma once
+
+// Minimal stand-in for the Arduino core so the portable LIFX protocol headers
+// compile in the host build. Only what lifx_protocol.h / lifx_utils.h /
+// lifx_device.cpp actually use is provided here.
+
+#include <cstdint>
+#include <cstring>
+
+typedef uint8_t byte;
+
+#define lowByte(w) ((uint8_t)((w) & 0xff))
+#define highByte(w) ((uint8_t)((w) >> 8))
+
+inline uint16_t word(uint8_t h, uint8_t l) { return (uint16_t)((h << 8) | l); }
+
+// Out of line as in the Arduino core (WMath.cpp), so benchmarks pay the
+// divisions the ESP build does
+__attribute__((noinline)) inline long map(long x, long in_min, long in_max, long out_min, long out_max)
+{
+	return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
+}
@@ -0,0 +1,601 @@
+// Replay benchmark for the LIFX protocol core.
+//
+// Feeds captured LIFX LAN traffic through LifxDeviceSet::handle_datagram() and
+// reports per-message-type latency percentiles and overall packets/sec.
+//
+// Input can be:
+//   - a classic libpcap capture (Ethernet, raw IPv4, Linux cooked v1/v2);
+//     every UDP datagram to port 56700 is replayed
+//   - a binary log: "LIFXLOG1" followed by records of [uint32 LE length][bytes]
+//   - nothing, in which case a synthetic Light DJ style mix is generated
+//
+// Usage: lifx_bench [options] [capture.pcap|capture.lifxlog]
+//   -n N            synthetic packet count (default 20000)
+//   -f N            synthetic fleet size; unicast frames are spread over N
+//                   bulbs and only 1/N of them target the benchmarked one
+//   -i N            replay iterations over the input (default 5), each with
+//                   its client source ids changed
+//   -l N            packets handled between loop() calls (default 1); models
+//                   several frames arriving within one ESPHome loop iteration
+//   -z N            emulate an N zone strip; the synthetic SetColor share
+//                   becomes SetExtendedColorZones frames
+//   -t N            emulate an NxN tile; the synthetic SetColor share becomes
+//                   Set64 frames drawn into framebuffer 1, each image
+//                   presented with CopyFrameBuffer
+//   -q N            rx queue size (default 0: handle frames inline); with a
+//                   queue, SETs are only applied by the following loop()
+//   -T N            keep a packet trace of N records (trace_size) and print
+//                   how many were written
+//   -w FILE         write the loaded/generated frames as a binary log
+//   -v              verbose core logging (debug: true)
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "lifx_device.h"
+
+using namespace esphome::lifx_emulation;
+
+namespace {
+
+typedef std::chrono::steady_clock bench_clock;
+
+const uint8_t BENCH_MAC[6] = {0xd0, 0x73, 0xd5, 0x00, 0x00, 0x01};
+const char LOG_MAGIC[8] = {'L', 'I', 'F', 'X', 'L', 'O', 'G', '1'};
+
+struct Frame {
+	std::vector<uint8_t> data;
+	LifxPeer peer;
+};
+
+class HostPlatform : public LifxTransport, public LifxLightOutput, public LifxZoneOutput, public LifxClock, public LifxStorage
+{
+public:
+	uint64_t tx_packets = 0;
+	uint64_t tx_bytes = 0;
+	uint64_t light_applies = 0;
+	uint64_t zone_applies = 0;
+	uint64_t saves = 0;
+
+	void send(const LifxPeer &peer, const uint8_t *data, size_t len) override
+	{
+		tx_packets++;
+		tx_bytes += len;
+	}
+	float signal_mw() override { return 0.0001f; }
+	void apply(const LifxLightCommand &cmd) override { light_applies++; }
+	void apply_zones(const LifxHSBK *zones, uint16_t count, uint16_t power, uint32_t duration) override { zone_applies++; }
+	uint32_t millis() override
+	{
+		return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+			bench_clock::now() - start_).count();
+	}
+	uint32_t micros() override
+	{
+		return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(
+			bench_clock::now() - start_).count();
+	}
+	uint64_t utc_seconds() override
+	{
+		return (uint64_t)std::chrono::duration_cast<std::chrono::seconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+	void save(const LifxPersistentState &state) override { saves++; }
+
+private:
+	bench_clock::time_point start_ = bench_clock::now();
+};
+
+uint16_t rd16(const uint8_t *p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+uint32_t rd32(const uint8_t *p) { return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24); }
+uint16_t rd16be(const uint8_t *p) { return (uint16_t)((p[0] << 8) | p[1]); }
+uint32_t swap32(uint32_t v) { return (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24); }
+
+bool read_file(const char *path, std::vector<uint8_t> &out)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return false;
+	uint8_t buf[65536];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		out.insert(out.end(), buf, buf + n);
+	fclose(f);
+	return true;
+}
+
+// Extracts the UDP payload of an IPv4 datagram addressed to the LIFX port
+bool ipv4_udp_payload(const uint8_t *ip, size_t len, Frame &frame)
+{
+	if (len < 20 || (ip[0] >> 4) != 4 || ip[9] != 17)
+		return false;
+	size_t ihl = (ip[0] & 0x0f) * 4;
+	if (len < ihl + 8)
+		return false;
+	const uint8_t *udp = ip + ihl;
+	if (rd16be(udp + 2) != LifxPort)
+		return false;
+	size_t udp_len = rd16be(udp + 4);
+	if (udp_len < 8 || ihl + udp_len > len)
+		return false;
+	memcpy(&frame.peer.ip, ip + 12, 4);
+	frame.peer.port = rd16be(udp);
+	frame.data.assign(udp + 8, udp + udp_len);
+	return true;
+}
+
+bool load_pcap(const std::vector<uint8_t> &file, std::vector<Frame> &frames)
+{
+	uint32_t magic = rd32(file.data());
+	bool swapped = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+	uint32_t linktype = rd32(file.data() + 20);
+	if (swapped)
+		linktype = swap32(linktype);
+
+	size_t pos = 24;
+	while (pos + 16 <= file.size())
+	{
+		uint32_t incl = rd32(file.data() + pos + 8);
+		if (swapped)
+			incl = swap32(incl);
+		pos += 16;
+		if (pos + incl > file.size())
+			break;
+		const uint8_t *pkt = file.data() + pos;
+		pos += incl;
+
+		size_t off;
+		uint16_t ethertype = 0x0800;
+		switch (linktype)
+		{
+		case 1: // Ethernet, optionally 802.1Q tagged
+			if (incl < 14)
+				continue;
+			off = 12;
+			ethertype = rd16be(pkt + off);
+			while (ethertype == 0x8100 && off + 6 <= incl)
+			{
+				off += 4;
+				ethertype = rd16be(pkt + off);
+			}
+			off += 2;
+			break;
+		case 101: // raw IP
+		case 228: // raw IPv4
+			off = 0;
+			break;
+		case 113: // Linux cooked v1
+			if (incl < 16)
+				continue;
+			ethertype = rd16be(pkt + 14);
+			off = 16;
+			break;
+		case 276: // Linux cooked v2
+			if (incl < 20)
+				continue;
+			ethertype = rd16be(pkt);
+			off = 20;
+			break;
+		default:
+			fprintf(stderr, "Unsupported pcap link type %u\n", linktype);
+			return false;
+		}
+		if (ethertype != 0x0800 || off > incl)
+			continue;
+
+		Frame frame;
+		if (ipv4_udp_payload(pkt + off, incl - off, frame) && frame.data.size() >= LifxPacketSize)
+			frames.push_back(frame);
+	}
+	return true;
+}
+
+bool load_log(const std::vector<uint8_t> &file, std::vector<Frame> &frames)
+{
+	size_t pos = sizeof(LOG_MAGIC);
+	while (pos + 4 <= file.size())
+	{
+		uint32_t len = rd32(file.data() + pos);
+		pos += 4;
+		if (pos + len > file.size())
+			break;
+		Frame frame;
+		frame.peer.ip = 0x0a01a8c0; // 192.168.1.10
+		frame.peer.port = LifxPort;
+		frame.data.assign(file.begin() + pos, file.begin() + pos + len);
+		frames.push_back(frame);
+		pos += len;
+	}
+	return true;
+}
+
+bool write_log(const char *path, const std::vector<Frame> &frames)
+{
+	FILE *f = fopen(path, "wb");
+	if (!f)
+		return false;
+	fwrite(LOG_MAGIC, 1, sizeof(LOG_MAGIC), f);
+	for (const Frame &frame : frames)
+	{
+		uint8_t len[4] = {
+			(uint8_t)frame.data.size(), (uint8_t)(frame.data.size() >> 8),
+			(uint8_t)(frame.data.size() >> 16), (uint8_t)(frame.data.size() >> 24)};
+		fwrite(len, 1, sizeof(len), f);
+		fwrite(frame.data.data(), 1, frame.data.size(), f);
+	}
+	fclose(f);
+	return true;
+}
+
+// Builds one LIFX frame; tagged frames go to all bulbs (zero target)
+Frame make_frame(uint16_t type, bool tagged, uint8_t flags, uint8_t seq, const std::vector<uint8_t> &payload, uint8_t bulb = 0)
+{
+	Frame frame;
+	frame.peer.ip = 0x0a01a8c0;
+	frame.peer.port = LifxPort;
+	std::vector<uint8_t> &d = frame.data;
+	d.assign(LifxPacketSize, 0);
+	uint16_t size = LifxPacketSize + payload.size();
+	uint16_t protocol = tagged ? LifxProtocol_AllBulbsRequest : LifxProtocol_BulbCommand;
+	d[0] = lowByte(size);
+	d[1] = highByte(size);
+	d[2] = lowByte(protocol);
+	d[3] = highByte(protocol);
+	d[4] = 0x11;
+	d[5] = 0x22;
+	d[6] = 0x33;
+	d[7] = 0x44;
+	if (!tagged)
+	{
+		memcpy(&d[8], BENCH_MAC, sizeof(BENCH_MAC));
+		d[13] += bulb;
+	}
+	d[22] = flags;
+	d[23] = seq;
+	d[32] = lowByte(type);
+	d[33] = highByte(type);
+	d.insert(d.end(), payload.begin(), payload.end());
+	return frame;
+}
+
+void put16(std::vector<uint8_t> &v, uint16_t x) { v.push_back(lowByte(x)); v.push_back(highByte(x)); }
+void put32(std::vector<uint8_t> &v, uint32_t x) { put16(v, x & 0xffff); put16(v, x >> 16); }
+
+// Roughly what a Light DJ show with Home Assistant polling looks like
+void generate_synthetic(size_t count, unsigned fleet, unsigned zones, unsigned tile, std::vector<Frame> &frames)
+{
+	// Set64 carries 64 pixels, i.e. this many whole rows of the tile
+	const unsigned tile_rows = tile ? std::max(1u, 64 / tile) : 1;
+	const unsigned tile_chunks = tile ? (tile + tile_rows - 1) / tile_rows : 1;
+	// As many zones per SetExtendedColorZones as one frame can carry
+	const unsigned max_colors = (LIFX_MAX_PACKET_LENGTH - LifxPacketSize - offsetof(LifxPayloadSetExtColorZones, colors)) / sizeof(LifxHSBK);
+	const unsigned per_frame = std::min({zones, 82u, max_colors});
+	uint32_t rng = 0x12345678;
+	for (size_t i = 0; i < count; i++)
+	{
+		rng = rng * 1664525 + 1013904223;
+		uint8_t seq = (uint8_t)i;
+		uint8_t bulb = (uint8_t)(i % fleet);
+		unsigned pick = (rng >> 16) % 100;
+		std::vector<uint8_t> p;
+		if (pick < 55 && zones)
+		{
+			uint16_t index = (uint16_t)((i * per_frame) % zones);
+			uint8_t n = (uint8_t)std::min<unsigned>(per_frame, zones - index);
+			put32(p, 0);
+			p.push_back(index + n >= zones ? APPLY_APPLY : APPLY_NO_APPLY);
+			put16(p, index);
+			p.push_back(n);
+			for (unsigned z = 0; z < n; z++)
+			{
+				put16(p, (uint16_t)(rng >> 8) + z * 800);
+				put16(p, 65535);
+				put16(p, 40000);
+				put16(p, 3500);
+			}
+			frames.push_back(make_frame(SET_EXT_COLOR_ZONES, false, NO_RESPONSE, seq, p, bulb));
+		}
+		else if (pick < 55 && tile)
+		{
+			unsigned chunk = i % tile_chunks;
+			p.push_back(0);
+			p.push_back(1);
+			p.push_back(1); // draw off screen
+			p.push_back(0);
+			p.push_back((uint8_t)(chunk * tile_rows));
+			p.push_back((uint8_t)tile);
+			put32(p, 0);
+			for (unsigned px = 0; px < 64; px++)
+			{
+				put16(p, (uint16_t)(rng >> 8) + px * 1000);
+				put16(p, 65535);
+				put16(p, 40000);
+				put16(p, 3500);
+			}
+			frames.push_back(make_frame(SET_TILE_STATE64, false, NO_RESPONSE, seq, p, bulb));
+			if (chunk == tile_chunks - 1)
+			{
+				std::vector<uint8_t> copy = {0, 1, 1, 0, 0, 0, 0, 0, (uint8_t)tile, (uint8_t)tile};
+				put32(copy, 0);
+				frames.push_back(make_frame(SET_TILE_BUFFER_COPY, false, NO_RESPONSE, seq, copy, bulb));
+			}
+		}
+		else if (pick < 55)
+		{
+			p.push_back(0);
+			put16(p, (uint16_t)(rng >> 8));
+			put16(p, 65535);
+			put16(p, (uint16_t)(rng >> 3) | 0x8000);
+			put16(p, 3500);
+			put32(p, 0);
+			frames.push_back(make_frame(SET_LIGHT_STATE, false, NO_RESPONSE, seq, p, bulb));
+		}
+		else if (pick < 70)
+		{
+			if (zones && (rng & 0x300) == 0)
+				frames.push_back(make_frame(GET_EXT_COLOR_ZONES, false, RES_REQUIRED, seq, p));
+			else if (tile && (rng & 0x300) == 0)
+			{
+				p = {0, 1, 0, 0, 0, (uint8_t)tile};
+				frames.push_back(make_frame(GET_TILE_STATE64, false, RES_REQUIRED, seq, p));
+			}
+			else
+				frames.push_back(make_frame(GET_LIGHT_STATE, false, RES_REQUIRED, seq, p));
+		}
+		else if (pick < 78)
+		{
+			put16(p, (rng & 0x100) ? 65535 : 0);
+			put32(p, 0);
+			frames.push_back(make_frame(SET_POWER_STATE2, false, ACK_REQUIRED, seq, p));
+		}
+		else if (pick < 85)
+		{
+			frames.push_back(make_frame(GET_PAN_GATEWAY, true, RES_REQUIRED, seq, p));
+		}
+		else if (pick < 90)
+		{
+			frames.push_back(make_frame(GET_POWER_STATE, false, RES_REQUIRED, seq, p));
+		}
+		else if (pick < 95)
+		{
+			p.push_back(0);
+			p.push_back(1);
+			put16(p, (uint16_t)(rng >> 8));
+			put16(p, 65535);
+			put16(p, 65535);
+			put16(p, 3500);
+			put32(p, 250);
+			float cycles = 2.0f;
+			uint8_t cb[4];
+			memcpy(cb, &cycles, sizeof(cb));
+			p.insert(p.end(), cb, cb + 4);
+			put16(p, 0);
+			p.push_back(WAVEFORM_SINE);
+			frames.push_back(make_frame(SET_WAVEFORM, false, NO_RESPONSE, seq, p));
+		}
+		else if (pick < 98)
+		{
+			frames.push_back(make_frame(GET_BULB_LABEL, false, RES_REQUIRED, seq, p));
+		}
+		else
+		{
+			p.assign(64, 0x5a);
+			frames.push_back(make_frame(ECHO_REQUEST, false, RES_REQUIRED, seq, p));
+		}
+	}
+}
+
+struct Stats {
+	std::vector<uint32_t> ns;
+};
+
+double pct(std::vector<uint32_t> &v, double p)
+{
+	size_t idx = (size_t)(p * (v.size() - 1) + 0.5);
+	return v[idx] / 1000.0;
+}
+
+void print_row(const char *name, unsigned type, std::vector<uint32_t> &v)
+{
+	std::sort(v.begin(), v.end());
+	uint64_t sum = 0;
+	for (uint32_t x : v)
+		sum += x;
+	printf("%-26s %5u %9zu %9.2f %9.2f %9.2f %9.2f %9.2f\n", name, type, v.size(),
+		sum / 1000.0 / v.size(), pct(v, 0.5), pct(v, 0.9), pct(v, 0.99), v.back() / 1000.0);
+}
+
+void usage()
+{
+	fprintf(stderr, "usage: lifx_bench [-n synthetic_count] [-f fleet_size] [-i iterations] [-l packets_per_loop] [-z zones] [-t tile_side] [-q rx_queue_size] [-T trace_size] [-w out.lifxlog] [-v] [capture.pcap|capture.lifxlog]\n");
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+	size_t synthetic = 20000;
+	unsigned fleet = 1;
+	int iterations = 5;
+	int per_loop = 1;
+	int queue_size = 0;
+	int trace_size = 0;
+	unsigned zones = 0;
+	unsigned tile = 0;
+	const char *input = nullptr;
+	const char *write_path = nullptr;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "-n" && i + 1 < argc)
+			synthetic = strtoul(argv[++i], nullptr, 10);
+		else if (arg == "-f" && i + 1 < argc)
+			fleet = std::max(1, atoi(argv[++i]));
+		else if (arg == "-i" && i + 1 < argc)
+			iterations = atoi(argv[++i]);
+		else if (arg == "-l" && i + 1 < argc)
+			per_loop = std::max(1, atoi(argv[++i]));
+		else if (arg == "-z" && i + 1 < argc)
+			zones = std::min(LIFX_MAX_ZONES, std::max(0, atoi(argv[++i])));
+		else if (arg == "-t" && i + 1 < argc)
+			tile = std::min(LIFX_MAX_TILE_SIDE, std::max(0, atoi(argv[++i])));
+		else if (arg == "-q" && i + 1 < argc)
+			queue_size = std::max(0, atoi(argv[++i]));
+		else if (arg == "-T" && i + 1 < argc)
+			trace_size = std::min(65535, std::max(0, atoi(argv[++i])));
+		else if (arg == "-w" && i + 1 < argc)
+			write_path = argv[++i];
+		else if (arg == "-v")
+			lifx_host_log_level = 4;
+		else if (arg[0] != '-' && !input)
+			input = argv[i];
+		else
+		{
+			usage();
+			return 2;
+		}
+	}
+
+	std::vector<Frame> frames;
+	if (input)
+	{
+		std::vector<uint8_t> file;
+		if (!read_file(input, file) || file.size() < 24)
+		{
+			fprintf(stderr, "Cannot read %s\n", input);
+			return 1;
+		}
+		uint32_t magic = rd32(file.data());
+		bool ok;
+		if (magic == 0xa1b2c3d4 || magic == 0xd4c3b2a1 || magic == 0xa1b23c4d || magic == 0x4d3cb2a1)
+			ok = load_pcap(file, frames);
+		else if (memcmp(file.data(), LOG_MAGIC, sizeof(LOG_MAGIC)) == 0)
+			ok = load_log(file, frames);
+		else
+		{
+			fprintf(stderr, "%s is neither a pcap nor a LIFXLOG1 file\n", input);
+			return 1;
+		}
+		if (!ok)
+			return 1;
+		printf("Loaded %zu LIFX frames from %s\n", frames.size(), input);
+	}
+	else
+	{
+		generate_synthetic(synthetic, fleet, zones, tile, frames);
+		printf("Generated %zu synthetic LIFX frames\n", frames.size());
+	}
+	if (frames.empty())
+	{
+		fprintf(stderr, "Nothing to replay\n");
+		return 1;
+	}
+	if (write_path && !write_log(write_path, frames))
+	{
+		fprintf(stderr, "Cannot write %s\n", write_path);
+		return 1;
+	}
+
+	HostPlatform platform;
+	LifxDevice device;
+	device.set_mac(BENCH_MAC);
+	device.set_bulb_label("Bench Bulb");
+	device.set_transport(&platform);
+	device.set_light_output(&platform);
+	device.set_clock(&platform);
+	device.set_storage(&platform);
+	device.set_debug(lifx_host_log_level >= 4);
+	device.set_rx_queue_size(queue_size);
+	device.set_trace_size(trace_size);
+	device.set_zone_count(zones);
+	if (!zones)
+		device.set_tile_size(tile, tile);
+	device.set_zone_output(&platform);
+	device.begin();
+	// The rx queue lives in the set, as on the ESP
+	LifxDeviceSet devices;
+	devices.add(&device);
+
+	std::map<uint16_t, Stats> per_type;
+	Stats all, loop_stats;
+	int since_loop = 0;
+	auto wall_start = bench_clock::now();
+	for (int it = 0; it < iterations; it++)
+	{
+		// Each pass comes from other client sources; replaying the same ones
+		// would turn every pass after the first into retransmissions
+		if (it)
+		{
+			for (Frame &frame : frames)
+			{
+				if (frame.data.size() >= LifxPacketSize)
+					frame.data[7]++;
+			}
+		}
+		for (const Frame &frame : frames)
+		{
+			uint16_t type = frame.data.size() >= LifxPacketSize ? rd16(&frame.data[32]) : 0;
+			auto t0 = bench_clock::now();
+			devices.handle_datagram(frame.data.data(), frame.data.size(), frame.peer);
+			auto t1 = bench_clock::now();
+
+			uint32_t ns = (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
+			per_type[type].ns.push_back(ns);
+			all.ns.push_back(ns);
+
+			if (++since_loop >= per_loop)
+			{
+				since_loop = 0;
+				device.loop();
+				auto t2 = bench_clock::now();
+				loop_stats.ns.push_back((uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count());
+			}
+		}
+	}
+	double wall_s = std::chrono::duration<double>(bench_clock::now() - wall_start).count();
+
+	printf("\n%-26s %5s %9s %9s %9s %9s %9s %9s\n", "message", "type", "count", "mean_us", "p50_us", "p90_us", "p99_us", "max_us");
+	for (auto &entry : per_type)
+		print_row(lifx_packet_type_name(entry.first), entry.first, entry.second.ns);
+	print_row("(all packets)", 0, all.ns);
+	print_row("(loop)", 0, loop_stats.ns);
+
+	printf("\n%zu packets in %.3f s: %.0f packets/sec (including loop())\n",
+		all.ns.size(), wall_s, all.ns.size() / wall_s);
+	printf("tx: %llu packets, %llu bytes; light applies: %llu; zone applies: %llu; saves: %llu; not for us: %u\n",
+		(unsigned long long)platform.tx_packets, (unsigned long long)platform.tx_bytes,
+		(unsigned long long)platform.light_applies, (unsigned long long)platform.zone_applies,
+		(unsigned long long)platform.saves,
+		device.get_rx_not_for_us());
+	printf("dispatch: %u unknown, %u short payload\n", device.get_dispatch_unknown(), device.get_dispatch_short());
+	printf("light updates: %u applied, %u coalesced\n", device.get_light_applied(), device.get_light_coalesced());
+	printf("repeated SETs not applied: %u duplicate, %u stale\n", device.get_rx_duplicates(), device.get_rx_stale());
+	printf("cached state payloads: %u re-encodes\n", device.get_snapshot_encodes());
+	device.flush_state();
+	printf("state saves: %u requested, %u written, %u unchanged\n",
+		device.get_save_requests(), device.get_save_writes(), device.get_save_unchanged());
+	printf("transition frames: %u\n", device.get_transition_frames());
+	static const char *const stages[LATENCY_STAGES] = {"receive", "dispatch", "light", "save", "send"};
+	for (int stage = 0; stage < LATENCY_STAGES; stage++)
+	{
+		uint32_t counts[LIFX_LATENCY_BUCKETS];
+		device.get_latency((LifxLatencyStage) stage).read(counts);
+		printf("%s latency (device histogram): p50 <= %u us, p99 <= %u us\n", stages[stage],
+			(unsigned) lifx_latency_percentile(counts, 50), (unsigned) lifx_latency_percentile(counts, 99));
+	}
+	printf("waveform frames: %u rendered, %u late, %u missed\n",
+		device.get_waveform_frames(), device.get_waveform_late(), device.get_waveform_missed());
+	if (queue_size)
+		printf("rx queue: %u answered in callback, %u dropped\n", device.get_rx_fast(), device.get_rx_queue_dropped());
+	if (trace_size)
+		printf("trace: %u records written\n", device.get_trace_written());
+	return 0;
+}
@@ -0,0 +1,345 @@
+// Microbenchmark for the HSBK -> RGB conversion used when rendering zone and
+// tile frames. Compares the per-pixel map() + hsb2rgb() path the component
+// used to take with the batch lifx_hsbk_to_rgb() kernel on the same random
+// frames, and reports the largest per-channel difference between the two.
+// Also times one single-bulb update through setLightCombined()'s 8-bit path
+// against its precise_color path, both doing what the adapter does for an
+// rgbww_led, and one waveform frame with float math against the fixed point
+// tables. Finally times one frame of each on-device tile effect on a 16x16
+// tile. Every figure is the median of several runs on one pinned CPU, so
+// single digit differences between variants are not just scheduler noise.
+//
+// Usage: lifx_color_bench [-p pixels_per_frame] [-n frames] [-r runs] [-c cpu]
+//   -p N            pixels per frame (default 82, a full extended zone message)
+//   -n N            frames converted per variant and run (default 400000)
+//   -r N            runs per variant, the median is reported (default 9)
+//   -c N            CPU to pin to on Linux (default: the one it starts on)
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "lifx_color.h"
+#include "lifx_tile_effect.h"
+#include "lifx_utils.h"
+#include "lifx_waveform.h"
+
+using namespace esphome::lifx_emulation;
+
+namespace {
+
+typedef std::chrono::steady_clock bench_clock;
+
+void convert_scalar(const LifxHSBK *in, LifxRGB *out, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		uint8_t rgbColor[3];
+		int this_hue = map(in[i].hue, 0, 65535, 0, 767);
+		int this_sat = map(in[i].saturation, 0, 65535, 0, 255);
+		int this_bri = map(in[i].brightness, 0, 65535, 0, 255);
+		hsb2rgb(this_hue, this_sat, this_bri, rgbColor);
+		out[i].r = rgbColor[0];
+		out[i].g = rgbColor[1];
+		out[i].b = rgbColor[2];
+	}
+}
+
+// The LightCall fields setLightCombined() sets, one store per setter
+struct FloatColor {
+	float r, g, b, cw, ww, mireds, color_brightness, white, brightness;
+};
+
+// What LifxEmulation::setup() reads from an rgbww_led's traits (RGB and
+// cold/warm white, 153-370 mireds). Written in main() so the branches on it
+// are not folded away, as they cannot be on the device either.
+LifxWhiteTraits white_traits;
+
+// setLightCombined() without precise_color
+void update_legacy(const LifxHSBK *in, FloatColor *out, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		out[i].brightness = (float) in[i].brightness / 65535;
+		if (in[i].saturation < 1)
+		{
+			uint16_t mireds = 1000000 / in[i].kelvin;
+			out[i].mireds = mireds;
+			continue;
+		}
+		LifxRGB rgb;
+		lifx_hsbk_to_rgb(&in[i], &rgb, 1);
+		out[i].r = (float) rgb.r / 255;
+		out[i].g = (float) rgb.g / 255;
+		out[i].b = (float) rgb.b / 255;
+		out[i].cw = 0.0f;
+		out[i].ww = 0.0f;
+	}
+}
+
+// setLightCombined() with precise_color: setWhitePrecise() and setColorPrecise()
+void update_precise(const LifxHSBK *in, FloatColor *out, size_t count)
+{
+	const LifxWhiteTraits &traits = white_traits;
+	for (size_t i = 0; i < count; i++)
+	{
+		out[i].brightness = (float) in[i].brightness / 65535;
+		if (in[i].saturation < 1)
+		{
+			if (traits.cold_warm)
+			{
+				uint16_t warm = lifx_kelvin_warm_share(in[i].kelvin, traits.cold_mireds, traits.warm_mireds);
+				out[i].cw = (65535 - warm) / 65535.0f;
+				out[i].ww = warm / 65535.0f;
+			}
+			else if (traits.color_temperature)
+			{
+				out[i].mireds = 1000000.0f / in[i].kelvin;
+			}
+			else if (traits.rgb)
+			{
+				LifxHSBK white = {0, 0, 65535, in[i].kelvin};
+				LifxRGB16 mix;
+				lifx_hsbk_to_rgb16(white, mix);
+				out[i].r = mix.r / 65535.0f;
+				out[i].g = mix.g / 65535.0f;
+				out[i].b = mix.b / 65535.0f;
+				out[i].color_brightness = 1.0f;
+				if (traits.white)
+					out[i].white = 0.0f;
+				continue;
+			}
+			if (traits.rgb)
+				out[i].color_brightness = 0.0f;
+			continue;
+		}
+		LifxRGB16 rgb;
+		lifx_hsbk_to_rgb16(in[i], rgb);
+		out[i].r = rgb.r / 65535.0f;
+		out[i].g = rgb.g / 65535.0f;
+		out[i].b = rgb.b / 65535.0f;
+		out[i].cw = 0.0f;
+		out[i].ww = 0.0f;
+	}
+}
+
+// One SINE waveform frame per color with the float math renderWaveform() used to do
+void waveform_float(const LifxHSBK *in, LifxHSBK *out, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		float cycle_pos = fmodf((float)in[i].brightness / 1000.0f, 1.0f);
+		float f = (1.0f - cosf(cycle_pos * 2.0f * (float)M_PI)) / 2.0f;
+		out[i].saturation = (uint16_t)((float)in[i].saturation + f * ((float)in[i].kelvin - (float)in[i].saturation));
+		out[i].brightness = (uint16_t)((float)in[i].hue + f * ((float)in[i].saturation - (float)in[i].hue));
+	}
+}
+
+// The same frame from the phase accumulator and table
+void waveform_fixed(const LifxHSBK *in, LifxHSBK *out, size_t count)
+{
+	const uint32_t phase_step = 0xFFFFFFFFu / 1000;
+	for (size_t i = 0; i < count; i++)
+	{
+		uint32_t f = lifx_waveform_shape(WAVEFORM_SINE, (in[i].brightness % 1000) * phase_step);
+		f += f >> 15;
+		out[i].saturation = lifx_lerp16(in[i].saturation, in[i].kelvin, f);
+		out[i].brightness = lifx_lerp16(in[i].hue, in[i].saturation, f);
+	}
+}
+
+size_t runs = 9;
+
+double median(std::vector<double> values)
+{
+	std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+	return values[values.size() / 2];
+}
+
+// Median of runs calls to measure()
+template <typename F> double median_of_runs(F measure)
+{
+	std::vector<double> results(runs);
+	for (double &result : results)
+		result = measure();
+	return median(results);
+}
+
+template <typename F, typename T>
+double run_ns_per_pixel(F convert, const std::vector<LifxHSBK> &in, std::vector<T> &out, size_t pixels, size_t frames)
+{
+	size_t frame_count = in.size() / pixels;
+	auto t0 = bench_clock::now();
+	for (size_t f = 0; f < frames; f++)
+	{
+		size_t at = (f % frame_count) * pixels;
+		convert(&in[at], &out[at], pixels);
+	}
+	auto t1 = bench_clock::now();
+	return std::chrono::duration<double, std::nano>(t1 - t0).count() / ((double) frames * pixels);
+}
+
+template <typename F, typename T>
+double time_ns_per_pixel(F convert, const std::vector<LifxHSBK> &in, std::vector<T> &out, size_t pixels, size_t frames)
+{
+	return median_of_runs([&] { return run_ns_per_pixel(convert, in, out, pixels, frames); });
+}
+
+// Times a and b over the same frames in alternating slices, each going first
+// every other slice, so clock drift and interruptions hit both alike
+template <typename A, typename B, typename T>
+void run_interleaved(A a, B b, const std::vector<LifxHSBK> &in, std::vector<T> &out, size_t pixels, size_t frames,
+	double &a_ns, double &b_ns)
+{
+	size_t frame_count = in.size() / pixels;
+	double a_total = 0, b_total = 0;
+	for (size_t f = 0; f < frames; f += frame_count)
+	{
+		size_t slice = std::min(frame_count, frames - f) * pixels;
+		bool first_a = (f / frame_count) & 1;
+		for (int pass = 0; pass < 2; pass++)
+		{
+			auto t0 = bench_clock::now();
+			if (first_a == (pass == 0))
+				a(in.data(), out.data(), slice);
+			else
+				b(in.data(), out.data(), slice);
+			auto t1 = bench_clock::now();
+			(first_a == (pass == 0) ? a_total : b_total) += std::chrono::duration<double, std::nano>(t1 - t0).count();
+		}
+	}
+	a_ns = a_total / ((double) frames * pixels);
+	b_ns = b_total / ((double) frames * pixels);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+	size_t pixels = 82;
+	size_t frames = 400000;
+	int cpu = -1;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "-p" && i + 1 < argc)
+			pixels = std::max(1, atoi(argv[++i]));
+		else if (arg == "-n" && i + 1 < argc)
+			frames = std::max(1, atoi(argv[++i]));
+		else if (arg == "-r" && i + 1 < argc)
+			runs = std::max(1, atoi(argv[++i]));
+		else if (arg == "-c" && i + 1 < argc)
+			cpu = atoi(argv[++i]);
+		else
+		{
+			fprintf(stderr, "usage: lifx_color_bench [-p pixels_per_frame] [-n frames] [-r runs] [-c cpu]\n");
+			return 2;
+		}
+	}
+
+	// Stay on one CPU, so no variant's runs are split over cores and caches
+#ifdef __linux__
+	if (cpu < 0)
+		cpu = sched_getcpu();
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+		fprintf(stderr, "Cannot pin to CPU %d, running unpinned\n", cpu);
+#endif
+	white_traits = {true, false, true, false, 153.0f, 370.0f};
+
+	// 64 distinct frames keep the input out of the branch predictor's reach
+	const size_t frame_count = 64;
+	std::vector<LifxHSBK> in(frame_count * pixels);
+	uint32_t rng = 0x12345678;
+	for (LifxHSBK &color : in)
+	{
+		rng = rng * 1664525 + 1013904223;
+		color.hue = (uint16_t)(rng >> 16);
+		rng = rng * 1664525 + 1013904223;
+		color.saturation = (uint16_t)(rng >> 16);
+		rng = rng * 1664525 + 1013904223;
+		color.brightness = (uint16_t)(rng >> 16);
+		color.kelvin = 1500 + (rng >> 8) % 7500;
+		// Some whites and partly desaturated colors, as Home Assistant sends
+		if ((rng & 0x700) == 0)
+			color.saturation = 0;
+	}
+	std::vector<LifxRGB> scalar(in.size()), batch(in.size());
+
+	// Warm up, and fill both outputs completely for the comparison
+	convert_scalar(in.data(), scalar.data(), in.size());
+	lifx_hsbk_to_rgb(in.data(), batch.data(), in.size());
+	int max_diff = 0;
+	for (size_t i = 0; i < in.size(); i++)
+	{
+		max_diff = std::max(max_diff, abs(scalar[i].r - batch[i].r));
+		max_diff = std::max(max_diff, abs(scalar[i].g - batch[i].g));
+		max_diff = std::max(max_diff, abs(scalar[i].b - batch[i].b));
+	}
+
+	double scalar_ns = time_ns_per_pixel(convert_scalar, in, scalar, pixels, frames);
+	double batch_ns = time_ns_per_pixel(lifx_hsbk_to_rgb, in, batch, pixels, frames);
+
+	printf("%zu frames of %zu pixels, median of %zu runs\n", frames, pixels, runs);
+	printf("%-26s %9s %12s\n", "variant", "ns/pixel", "frames/sec");
+	printf("%-26s %9.2f %12.0f\n", "map() + hsb2rgb()", scalar_ns, 1e9 / (scalar_ns * pixels));
+	printf("%-26s %9.2f %12.0f\n", "lifx_hsbk_to_rgb()", batch_ns, 1e9 / (batch_ns * pixels));
+	printf("speedup: %.1fx; max channel difference: %d\n", scalar_ns / batch_ns, max_diff);
+
+	// Single bulb updates, timed over the same colors
+	std::vector<FloatColor> updates(in.size());
+	std::vector<double> legacy(runs), precise(runs), ratio(runs);
+	for (size_t r = 0; r < runs; r++)
+	{
+		run_interleaved(update_legacy, update_precise, in, updates, pixels, frames, legacy[r], precise[r]);
+		ratio[r] = precise[r] / legacy[r];
+	}
+	std::sort(ratio.begin(), ratio.end());
+	printf("\n%-26s %9s\n", "bulb update", "ns/update");
+	printf("%-26s %9.2f\n", "8-bit (default)", median(legacy));
+	printf("%-26s %9.2f\n", "16-bit (precise_color)", median(precise));
+	printf("precise_color overhead: %+.1f%% (runs %+.1f%% to %+.1f%%)\n", (median(ratio) - 1) * 100,
+		(ratio.front() - 1) * 100, (ratio.back() - 1) * 100);
+
+	// Waveform frames: brightness stands in for elapsed ms in a 1s SINE cycle
+	std::vector<LifxHSBK> wave(in.size());
+	double float_ns = time_ns_per_pixel(waveform_float, in, wave, pixels, frames);
+	double fixed_ns = time_ns_per_pixel(waveform_fixed, in, wave, pixels, frames);
+	printf("\n%-26s %9s\n", "waveform frame", "ns/frame");
+	printf("%-26s %9.2f\n", "fmodf + cosf + float lerp", float_ns);
+	printf("%-26s %9.2f\n", "phase table + lifx_lerp16", fixed_ns);
+
+	// Tile effects: one full frame of the largest supported tile
+	const uint8_t side = LIFX_MAX_TILE_SIDE;
+	std::vector<LifxHSBK> tile(side * side);
+	size_t tile_frames = frames / 40 + 1;
+	auto time_tile = [&](auto render) {
+		return median_of_runs([&] {
+			auto t0 = bench_clock::now();
+			for (size_t f = 0; f < tile_frames; f++)
+				render((uint32_t)(f * 997));
+			auto t1 = bench_clock::now();
+			return std::chrono::duration<double, std::micro>(t1 - t0).count() / tile_frames;
+		});
+	};
+	printf("\n%-26s %9s\n", "tile effect (16x16)", "us/frame");
+	printf("%-26s %9.2f\n", "MORPH", time_tile([&](uint32_t t) {
+		lifx_tile_morph(tile.data(), side, side, t, nullptr, 0); }));
+	printf("%-26s %9.2f\n", "FLAME", time_tile([&](uint32_t t) {
+		lifx_tile_flame(tile.data(), side, side, t, 65535); }));
+	printf("%-26s %9.2f\n", "SKY clouds", time_tile([&](uint32_t t) {
+		lifx_tile_clouds(tile.data(), side, side, t, 65535, 50, 200); }));
+	printf("%-26s %9.2f\n", "SKY sunrise", time_tile([&](uint32_t t) {
+		lifx_tile_sun(tile.data(), side, side, (uint16_t) t, 65535); }));
+	return 0;
+}
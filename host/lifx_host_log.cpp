@@ -0,0 +1,10 @@
+#include "lifx_platform.h"
+
+namespace esphome {
+namespace lifx_emulation {
+
+// Warnings and errors only unless the harness asks for more
+int lifx_host_log_level = 2;
+
+} // namespace lifx_emulation
+} // namespace esphome
@@ -0,0 +1,167 @@
+// Host test for the retransmission and reorder handling of SETs
+// (LifxDevice::replayed_): duplicates, 8-bit sequence wraparound, the
+// stale window, and the cached reply a retransmission gets.
+//
+// Usage: lifx_sequence_test; exits non-zero when any check fails.
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "lifx_device.h"
+
+using namespace esphome::lifx_emulation;
+
+namespace {
+
+class TestPlatform : public LifxTransport, public LifxLightOutput, public LifxClock, public LifxStorage
+{
+public:
+	uint32_t now = 1000;
+	unsigned applies = 0;
+	uint16_t shown_hue = 0;
+	unsigned acks = 0;
+	std::vector<uint16_t> replies; // hue of each LightState sent
+
+	void send(const LifxPeer &peer, const uint8_t *data, size_t len) override
+	{
+		uint16_t type = data[32] | (data[33] << 8);
+		if (type == ACKNOWLEDGEMENT)
+			acks++;
+		else if (type == LIGHT_STATUS)
+			replies.push_back(data[LifxPacketSize] | (data[LifxPacketSize + 1] << 8));
+	}
+	float signal_mw() override { return 0.0001f; }
+	void apply(const LifxLightCommand &cmd) override
+	{
+		applies++;
+		shown_hue = cmd.hue;
+	}
+	uint32_t millis() override { return now; }
+	uint64_t utc_seconds() override { return 0; }
+	void save(const LifxPersistentState &state) override {}
+};
+
+int failures = 0;
+
+#define CHECK(cond) \
+	do { if (!(cond)) { fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+struct Fixture {
+	TestPlatform platform;
+	LifxDevice device;
+
+	Fixture()
+	{
+		const uint8_t mac[6] = {0xd0, 0x73, 0xd5, 0x00, 0x00, 0x01};
+		device.set_mac(mac);
+		device.set_transport(&platform);
+		device.set_light_output(&platform);
+		device.set_clock(&platform);
+		device.set_storage(&platform);
+		device.set_transition_fps(0);
+		device.begin();
+		// Count only what the tests send, not the restored state
+		device.loop();
+		platform.applies = 0;
+	}
+
+	// SetColor with ack_required (and res_required with reply), then 10 ms pass
+	void set_color(uint32_t source, uint8_t sequence, uint16_t hue, bool reply = false)
+	{
+		uint8_t frame[LifxPacketSize + sizeof(LifxPayloadSetColor)] = {};
+		frame[0] = sizeof(frame);
+		frame[2] = lowByte(LifxProtocol_BulbCommand);
+		frame[3] = highByte(LifxProtocol_BulbCommand);
+		memcpy(&frame[4], &source, sizeof(source));
+		frame[22] = ACK_REQUIRED | (reply ? RES_REQUIRED : 0);
+		frame[23] = sequence;
+		frame[32] = lowByte(SET_LIGHT_STATE);
+		frame[33] = highByte(SET_LIGHT_STATE);
+		LifxPayloadSetColor color = {};
+		color.hue = hue;
+		color.brightness = 65535;
+		memcpy(&frame[LifxPacketSize], &color, sizeof(color));
+		device.handle_datagram(frame, sizeof(frame), LifxPeer{0x0a01a8c0, LifxPort});
+		device.loop();
+		platform.now += 10;
+	}
+};
+
+void test_duplicate()
+{
+	Fixture f;
+	f.set_color(0xAA, 5, 100);
+	f.set_color(0xAA, 5, 100);
+	CHECK(f.platform.applies == 1);
+	CHECK(f.platform.acks == 2);
+	CHECK(f.device.get_rx_duplicates() == 1);
+	// Same sequence with another payload: a client that never counts up
+	f.set_color(0xAA, 5, 200);
+	CHECK(f.platform.shown_hue == 200);
+	// Source 0 is not tracked
+	f.set_color(0, 3, 300);
+	f.set_color(0, 3, 300);
+	CHECK(f.platform.applies == 4);
+}
+
+void test_wraparound()
+{
+	Fixture f;
+	f.set_color(0xBB, 254, 1);
+	f.set_color(0xBB, 255, 2);
+	f.set_color(0xBB, 0, 3);
+	f.set_color(0xBB, 1, 4);
+	CHECK(f.platform.shown_hue == 4);
+	CHECK(f.device.get_rx_stale() == 0);
+	// 255 arriving after 1 was overtaken across the wrap
+	f.set_color(0xBB, 255, 5);
+	CHECK(f.platform.shown_hue == 4);
+	CHECK(f.device.get_rx_stale() == 1);
+}
+
+void test_stale_window()
+{
+	Fixture f;
+	f.set_color(0xCC, 40, 1);
+	f.set_color(0xCC, 30, 2);
+	CHECK(f.platform.shown_hue == 1);
+	CHECK(f.device.get_rx_stale() == 1);
+	CHECK(f.platform.acks == 2);
+	// 16 and more behind: the counter moved on for other bulbs
+	f.set_color(0xCC, 24, 3);
+	CHECK(f.platform.shown_hue == 3);
+	f.set_color(0xCC, 200, 6);
+	CHECK(f.platform.shown_hue == 6);
+	// Close behind, but long after the last change
+	f.set_color(0xCC, 60, 4);
+	f.platform.now += LIFX_SEQUENCE_REORDER_MS;
+	f.set_color(0xCC, 59, 5);
+	CHECK(f.platform.shown_hue == 5);
+	CHECK(f.device.get_rx_stale() == 1);
+}
+
+void test_cached_reply()
+{
+	Fixture f;
+	f.set_color(0xDD, 7, 100, true);
+	f.set_color(0xEE, 1, 999);
+	f.set_color(0xDD, 7, 100, true);
+	CHECK(f.platform.shown_hue == 999);
+	// The retransmission gets the reply it missed, not the newer color
+	CHECK(f.platform.replies.size() == 2 && f.platform.replies[1] == 100);
+}
+
+} // namespace
+
+int main()
+{
+	test_duplicate();
+	test_wraparound();
+	test_stale_window();
+	test_cached_reply();
+	if (failures)
+		return 1;
+	printf("lifx_sequence_test: all checks passed\n");
+	return 0;
+}
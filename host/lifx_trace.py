@@ -0,0 +1,286 @@
+#!/usr/bin/env python3
+"""Decode the lifx_emulation packet trace (trace_size) into a timeline or pcap.
+
+The trace comes either from the log, after calling dump_trace() on the
+component (lines "trace <lane> <first> <hex records>"), or straight from
+the device with a GetTrace (0xFF00) request:
+
+  lifx_trace.py esphome.log                 # timeline from a captured log
+  lifx_trace.py --fetch 192.168.1.50        # ask the device over UDP
+  lifx_trace.py --fetch 192.168.1.50 --pcap trace.pcap
+
+The pcap holds one IPv4/UDP frame per received request and per response,
+with the LIFX header rebuilt from the record and a zeroed payload of the
+recorded size, so Wireshark's LIFX dissector shows the timing and types.
+
+Record layout (lifx_trace.h, 16 bytes little endian): uint32 time_us,
+uint32 source, uint16 type, uint16 size, uint16 handler_us, uint8 sequence,
+uint8 flags (event << 4 | tagged 0x04 | ack_required 0x02 | res_required 0x01).
+"""
+
+import argparse
+import os
+import re
+import socket
+import struct
+import sys
+import time
+
+LIFX_PORT = 56700
+GET_TRACE = 0xFF00
+STATE_TRACE = 0xFF01
+RECORD = struct.Struct("<IIHHHBB")
+STATE_TRACE_HEADER = struct.Struct("<BBHII")
+
+EVENTS = {1: "fast", 2: "queued", 3: "dropped", 4: "inline", 5: "dispatch", 6: "sent"}
+LANES = {0: "net", 1: "loop"}
+# Events that put a frame on the wire (the rest describe handling)
+WIRE_EVENTS = {1, 2, 3, 4, 6}
+
+TYPE_NAMES = {
+    2: "GetService",
+    3: "StateService",
+    12: "GetHostInfo",
+    13: "StateHostInfo",
+    14: "GetHostFirmware",
+    15: "StateHostFirmware",
+    16: "GetWifiInfo",
+    17: "StateWifiInfo",
+    18: "GetWifiFirmware",
+    19: "StateWifiFirmware",
+    20: "GetPower",
+    21: "SetPower",
+    22: "StatePower",
+    23: "GetLabel",
+    24: "SetLabel",
+    25: "StateLabel",
+    26: "GetTags",
+    27: "SetTags",
+    28: "StateTags",
+    29: "GetTagLabels",
+    30: "SetTagLabels",
+    31: "StateTagLabels",
+    32: "GetVersion",
+    33: "StateVersion",
+    34: "GetInfo",
+    35: "StateInfo",
+    38: "SetReboot",
+    45: "Acknowledgement",
+    46: "ResetBulb",
+    48: "GetLocation",
+    49: "SetLocation",
+    50: "StateLocation",
+    51: "GetGroup",
+    52: "SetGroup",
+    53: "StateGroup",
+    54: "GetAuth",
+    55: "SetAuth",
+    56: "StateAuth",
+    58: "EchoRequest",
+    59: "EchoResponse",
+    101: "LightGet",
+    102: "LightSetColor",
+    103: "LightSetWaveform",
+    107: "LightState",
+    116: "LightGetPower",
+    117: "LightSetPower",
+    118: "LightStatePower",
+    119: "LightSetWaveformOptional",
+    120: "GetInfrared",
+    121: "StateInfrared",
+    122: "SetInfrared",
+    142: "GetHevCycle",
+    143: "SetHevCycle",
+    144: "StateHevCycle",
+    145: "GetHevCycleConfiguration",
+    146: "SetHevCycleConfiguration",
+    147: "StateHevCycleConfiguration",
+    148: "GetLastHevCycleResult",
+    149: "StateLastHevCycleResult",
+    201: "GetCloud",
+    202: "SetCloud",
+    203: "StateCloud",
+    204: "GetCloudAuth",
+    205: "SetCloudAuth",
+    206: "StateCloudAuth",
+    209: "GetCloudBroker",
+    210: "SetCloudBroker",
+    211: "StateCloudBroker",
+    223: "StateUnhandled",
+    501: "SetColorZones",
+    502: "GetColorZones",
+    503: "StateZone",
+    506: "StateMultiZone",
+    507: "GetMultiZoneEffect",
+    508: "SetMultiZoneEffect",
+    509: "StateMultiZoneEffect",
+    510: "SetExtendedColorZones",
+    511: "GetExtendedColorZones",
+    512: "StateExtendedColorZones",
+    701: "GetDeviceChain",
+    702: "StateDeviceChain",
+    703: "SetUserPosition",
+    707: "Get64",
+    711: "State64",
+    715: "Set64",
+    716: "CopyFrameBuffer",
+    718: "GetTileEffect",
+    719: "SetTileEffect",
+    720: "StateTileEffect",
+    816: "GetRPower",
+    817: "SetRPower",
+    818: "StateRPower",
+    65280: "GetTrace",
+    65281: "StateTrace",
+}
+
+
+def parse_records(lane, data, device=""):
+    records = []
+    for offset in range(0, len(data) - RECORD.size + 1, RECORD.size):
+        time_us, source, type_, size, handler_us, sequence, flags = RECORD.unpack_from(data, offset)
+        if flags == 0:
+            continue  # never written
+        records.append(
+            {
+                "device": device,
+                "lane": lane,
+                "time_us": time_us,
+                "source": source,
+                "type": type_,
+                "size": size,
+                "handler_us": handler_us,
+                "sequence": sequence,
+                "event": flags >> 4,
+                "flags": flags & 0x0F,
+            }
+        )
+    return records
+
+
+def read_log(stream):
+    pattern = re.compile(r"trace (\d+) (\d+) ([0-9a-f]+)")
+    chunks = {}
+    for line in stream:
+        match = pattern.search(line)
+        if match:
+            lane, first = int(match.group(1)), int(match.group(2))
+            # A later dump of the same records replaces the earlier one
+            chunks[(lane, first)] = bytes.fromhex(match.group(3))
+    records = []
+    for (lane, _first), data in sorted(chunks.items()):
+        records += parse_records(lane, data)
+    return records
+
+
+def fetch(host, timeout):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.settimeout(timeout)
+    source = os.getpid() & 0xFFFFFFFF or 1
+    # size, protocol 1024 addressable, source, all-zero target, res_ack, sequence, type
+    request = struct.pack("<HHI6s8sBBQHH", 36, 0x1400, source, b"", b"", 0, 0, 0, GET_TRACE, 0)
+    sock.sendto(request, (host, LIFX_PORT))
+    chunks = {}
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        try:
+            data, _addr = sock.recvfrom(2048)
+        except socket.timeout:
+            break
+        if len(data) < 36 + STATE_TRACE_HEADER.size or struct.unpack_from("<H", data, 32)[0] != STATE_TRACE:
+            continue
+        device = data[8:14].hex(":")
+        lane, count, _capacity, first, _written = STATE_TRACE_HEADER.unpack_from(data, 36)
+        offset = 36 + STATE_TRACE_HEADER.size
+        chunks[(device, lane, first)] = data[offset : offset + count * RECORD.size]
+    records = []
+    for (device, lane, _first), data in sorted(chunks.items()):
+        records += parse_records(lane, data, device)
+    return records
+
+
+def unwrap(records):
+    """time_us wraps every ~71 minutes; make it monotonic per device and lane."""
+    last = {}
+    for record in records:
+        key = (record["device"], record["lane"])
+        base, previous = last.get(key, (0, None))
+        if previous is not None and record["time_us"] + 0x80000000 < previous:
+            base += 1 << 32
+        last[key] = (base, record["time_us"])
+        record["time"] = base + record["time_us"]
+    return sorted(records, key=lambda r: (r["time"], r["lane"]))
+
+
+def flag_text(flags):
+    return "".join(
+        letter if flags & bit else "-" for bit, letter in ((0x04, "T"), (0x02, "A"), (0x01, "R"))
+    )
+
+
+def print_timeline(records):
+    if not records:
+        print("no trace records")
+        return
+    devices = len({r["device"] for r in records}) > 1
+    start = records[0]["time"]
+    print(
+        f"{'ms':>11} {'device' if devices else '':{17 if devices else 0}}"
+        f"{'lane':<5}{'event':<9}{'type':<26}{'source':>9} {'seq':>3} {'size':>5} {'flags':<5} {'us':>6}"
+    )
+    for r in records:
+        name = TYPE_NAMES.get(r["type"], f"type {r['type']}")
+        print(
+            f"{(r['time'] - start) / 1000:11.3f} {r['device'] + ' ' if devices else ''}"
+            f"{LANES.get(r['lane'], r['lane']):<5}{EVENTS.get(r['event'], r['event']):<9}{name:<26}"
+            f"{r['source']:08x}  {r['sequence']:3d} {r['size']:5d} {flag_text(r['flags']):<5} {r['handler_us']:6d}"
+        )
+
+
+def write_pcap(path, records):
+    client, bulb = bytes([10, 0, 0, 2]), bytes([10, 0, 0, 1])
+    with open(path, "wb") as out:
+        out.write(struct.pack("<IHHiIII", 0xA1B2C3D4, 2, 4, 0, 0, 65535, 101))  # raw IP
+        for r in records:
+            if r["event"] not in WIRE_EVENTS:
+                continue
+            size = max(r["size"], 36)
+            protocol = 0x1400 | (0x2000 if r["flags"] & 0x04 else 0)
+            lifx = struct.pack(
+                "<HHI6s8sBBQHH", size, protocol, r["source"], b"", b"", r["flags"] & 0x03,
+                r["sequence"], 0, r["type"], 0,
+            ) + bytes(size - 36)
+            src, dst = (bulb, client) if r["event"] == 6 else (client, bulb)
+            udp = struct.pack(">HHHH", LIFX_PORT, LIFX_PORT, 8 + len(lifx), 0) + lifx
+            ip = struct.pack(">BBHHHBBH4s4s", 0x45, 0, 20 + len(udp), 0, 0, 64, 17, 0, src, dst) + udp
+            seconds, micros = divmod(r["time"], 1000000)
+            out.write(struct.pack("<IIII", seconds & 0xFFFFFFFF, micros, len(ip), len(ip)))
+            out.write(ip)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode the lifx_emulation packet trace")
+    parser.add_argument("log", nargs="?", help="ESPHome log containing a dump_trace() output ('-' for stdin)")
+    parser.add_argument("--fetch", metavar="HOST", help="request the trace from the device over UDP")
+    parser.add_argument("--timeout", type=float, default=1.0, help="seconds to wait for --fetch replies")
+    parser.add_argument("--pcap", metavar="FILE", help="write a pcap instead of the timeline")
+    args = parser.parse_args()
+
+    if args.fetch:
+        records = fetch(args.fetch, args.timeout)
+    elif args.log:
+        with (sys.stdin if args.log == "-" else open(args.log, errors="replace")) as stream:
+            records = read_log(stream)
+    else:
+        parser.error("give a log file or --fetch HOST")
+
+    records = unwrap(records)
+    if args.pcap:
+        write_pcap(args.pcap, records)
+        print(f"wrote {sum(r['event'] in WIRE_EVENTS for r in records)} frames to {args.pcap}")
+    else:
+        print_timeline(records)
+
+
+if __name__ == "__main__":
+    main()